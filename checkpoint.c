@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+
+static uint64_t pageAlign(uint64_t offset) {
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	return (offset + page - 1) / page * page;
+}
+
+static size_t trailSize(const checkpointHeader *header) {
+	return (size_t) header->width * header->height * header->pixelSize;
+}
+
+// Fills in the magic, version and offsets of header. The checkpoint is written next to path first and
+// renamed over it, so a crash while saving leaves the previous one intact. Returns 0 on success
+int saveCheckpoint(const char *path, checkpointHeader *header, const void *trail, const void *particles) {
+	memcpy(header->magic, "SLIMECKP", sizeof(header->magic));
+	header->version = CHECKPOINT_VERSION;
+	header->trailOffset = pageAlign(sizeof(checkpointHeader));
+	header->particlesOffset = pageAlign(header->trailOffset + trailSize(header));
+
+	char tempPath[4096];
+	snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+	FILE *file = fopen(tempPath, "wb");
+	if (!file) {
+		fprintf(stderr, "Couldn't create checkpoint %s\n", tempPath);
+		return 1;
+	}
+	int failed = fwrite(header, sizeof(checkpointHeader), 1, file) != 1 ||
+		fseek(file, header->trailOffset, SEEK_SET) || fwrite(trail, trailSize(header), 1, file) != 1 ||
+		fseek(file, header->particlesOffset, SEEK_SET) ||
+		fwrite(particles, (size_t) header->particleCount * header->particleSize, 1, file) != 1 ||
+		fflush(file) || fsync(fileno(file));
+	failed |= fclose(file) != 0;
+	if (failed || rename(tempPath, path)) {
+		fprintf(stderr, "Couldn't write checkpoint %s\n", path);
+		unlink(tempPath);
+		return 1;
+	}
+	return 0;
+}
+
+// At most one checkpoint is written in the background at a time
+static pthread_t writer;
+static int writerStarted;
+static atomic_int writerDone;
+static const char *backgroundPath;
+static checkpointHeader backgroundHeader;
+static char *backgroundSnapshot;
+
+static void *writeInBackground(void *arg) {
+	(void) arg;
+	if (!saveCheckpoint(backgroundPath, &backgroundHeader, backgroundSnapshot,
+				backgroundSnapshot + pageAlign(trailSize(&backgroundHeader))))
+		printf("Saved checkpoint %s\n", backgroundPath);
+	free(backgroundSnapshot);
+	atomic_store_explicit(&writerDone, 1, memory_order_release);
+	return NULL;
+}
+
+// Waits for the checkpoint being written in the background, if any
+void finishCheckpoint() {
+	if (!writerStarted)
+		return;
+	pthread_join(writer, NULL);
+	writerStarted = 0;
+}
+
+// Returns a buffer to copy the trail of header into, and its particles at checkpointParticles() of it,
+// for saveCheckpointInBackground(). NULL while the previous checkpoint is still being written
+void *checkpointSnapshot(const checkpointHeader *header) {
+	if (writerStarted && !atomic_load_explicit(&writerDone, memory_order_acquire)) {
+		fprintf(stderr, "Still writing the previous checkpoint, skipping this one\n");
+		return NULL;
+	}
+	finishCheckpoint();
+	return malloc(pageAlign(trailSize(header)) + (size_t) header->particleCount * header->particleSize);
+}
+
+void *checkpointParticles(const checkpointHeader *header, void *snapshot) {
+	return (char*) snapshot + pageAlign(trailSize(header));
+}
+
+// Writes, syncs and renames the checkpoint from another thread, so the frame loop doesn't wait on the
+// disk. Takes over snapshot, from checkpointSnapshot()
+void saveCheckpointInBackground(const char *path, const checkpointHeader *header, void *snapshot) {
+	backgroundPath = path;
+	backgroundHeader = *header;
+	backgroundSnapshot = snapshot;
+	atomic_store_explicit(&writerDone, 0, memory_order_relaxed);
+	if (pthread_create(&writer, NULL, writeInBackground, NULL)) {
+		fprintf(stderr, "Couldn't start the checkpoint writer, writing it here\n");
+		writeInBackground(NULL);
+		return;
+	}
+	writerStarted = 1;
+}
+
+// Maps the checkpoint at path read only if it matches everything but the offsets of expected,
+// otherwise returns NULL. The caller munmaps mappedSize bytes when done with it
+void *loadCheckpoint(const char *path, const checkpointHeader *expected, size_t *mappedSize) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(checkpointHeader)) {
+		fprintf(stderr, "Checkpoint %s is truncated\n", path);
+		close(fd);
+		return NULL;
+	}
+	void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map checkpoint %s\n", path);
+		return NULL;
+	}
+
+	const checkpointHeader *header = mapping;
+	if (memcmp(header->magic, "SLIMECKP", sizeof(header->magic)) || header->version != CHECKPOINT_VERSION ||
+			header->backend != expected->backend || header->width != expected->width ||
+			header->height != expected->height || header->pixelSize != expected->pixelSize ||
+			header->particleCount != expected->particleCount ||
+			header->particleSize != expected->particleSize) {
+		fprintf(stderr, "Checkpoint %s is from a different version or configuration, not restoring it\n", path);
+		munmap(mapping, st.st_size);
+		return NULL;
+	}
+	if (header->trailOffset + trailSize(header) > (uint64_t) st.st_size ||
+			header->particlesOffset + (uint64_t) header->particleCount * header->particleSize > (uint64_t) st.st_size) {
+		fprintf(stderr, "Checkpoint %s is truncated\n", path);
+		munmap(mapping, st.st_size);
+		return NULL;
+	}
+	*mappedSize = st.st_size;
+	return mapping;
+}
@@ -0,0 +1,26 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// Saved simulation state to restart from instead of respawning every particle. Sections start
+// at page boundaries after the header, so a loaded checkpoint is used straight from its mapping
+#define CHECKPOINT_VERSION 2
+
+enum {
+	CHECKPOINT_CPU, // particle structs of slime.c and intensity trails
+	CHECKPOINT_VULKAN // vkParticle structs and RGBA trails
+};
+
+typedef struct {
+	char magic[8]; // "SLIMECKP"
+	uint32_t version, backend;
+	uint32_t width, height, pixelSize; // pixelSize in bytes
+	uint32_t particleCount, particleSize;
+	uint64_t trailOffset, particlesOffset; // from the start of the file
+} checkpointHeader;
+
+int saveCheckpoint(const char *path, checkpointHeader *header, const void *trail, const void *particles);
+void *checkpointSnapshot(const checkpointHeader *header);
+void *checkpointParticles(const checkpointHeader *header, void *snapshot);
+void saveCheckpointInBackground(const char *path, const checkpointHeader *header, void *snapshot);
+void finishCheckpoint();
+void *loadCheckpoint(const char *path, const checkpointHeader *expected, size_t *mappedSize);
@@ -0,0 +1,125 @@
+#include <vulkan/vulkan.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "deviceMemory.h"
+
+// Resources get aligned ranges of a few big VkDeviceMemory blocks instead of an allocation each.
+// Nothing is ever freed on its own, everything lives until freeDeviceMemory()
+#define BLOCK_SIZE (64ull << 20)
+#define MAX_BLOCKS 16
+
+typedef struct {
+	VkDeviceMemory mem;
+	uint32_t typeIndex;
+	VkDeviceSize size, used;
+	void *mapped; // whole block stays mapped if it's host visible
+} memBlock;
+
+static VkDevice dev;
+static VkPhysicalDeviceMemoryProperties memProps;
+static VkDeviceSize granularity;
+static uint32_t maxAllocations;
+static memBlock blocks[MAX_BLOCKS];
+static int blockCount;
+
+static VkResult result;
+#define vkFail(msg) \
+	if (result != VK_SUCCESS) {\
+		fprintf(stderr, (msg)); \
+		abort(); \
+	}
+
+void initDeviceMemory(VkPhysicalDevice physDev, VkDevice device) {
+	dev = device;
+	vkGetPhysicalDeviceMemoryProperties(physDev, &memProps);
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(physDev, &props);
+	// Aligning every range to this keeps buffers and optimal tiling images from ever sharing a page
+	granularity = props.limits.bufferImageGranularity;
+	maxAllocations = props.limits.maxMemoryAllocationCount;
+}
+
+static memBlock *newBlock(uint32_t typeIndex, VkDeviceSize size) {
+	if (blockCount == MAX_BLOCKS || (uint32_t)blockCount >= maxAllocations) {
+		fprintf(stderr, "Out of device memory blocks\n");
+		abort();
+	}
+	memBlock *block = blocks + blockCount;
+	block->typeIndex = typeIndex;
+	block->size = size > BLOCK_SIZE ? size : BLOCK_SIZE;
+	block->used = 0;
+	block->mapped = NULL;
+
+	VkMemoryAllocateInfo allocInfo;
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.pNext = NULL;
+	allocInfo.allocationSize = block->size;
+	allocInfo.memoryTypeIndex = typeIndex;
+	result = vkAllocateMemory(dev, &allocInfo, NULL, &block->mem);
+	vkFail("Failed to allocate device memory block\n");
+	if (memProps.memoryTypes[typeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		result = vkMapMemory(dev, block->mem, 0, VK_WHOLE_SIZE, 0, &block->mapped);
+		vkFail("Failed to map device memory block\n");
+	}
+	blockCount++;
+	return block;
+}
+
+// Returns the block with room for reqs in memory type typeIndex, and the offset of the room in it
+static memBlock *subAllocate(VkMemoryRequirements reqs, uint32_t typeIndex, const char *name, VkDeviceSize *offset) {
+	if (!(reqs.memoryTypeBits & (1 << typeIndex))) {
+		fprintf(stderr, "Can't store %s in memory type %u\n", name, typeIndex);
+		abort();
+	}
+	VkDeviceSize alignment = reqs.alignment > granularity ? reqs.alignment : granularity;
+
+	memBlock *block = NULL;
+	for (int i=0; i<blockCount; i++) {
+		*offset = (blocks[i].used + alignment - 1) / alignment * alignment;
+		if (blocks[i].typeIndex == typeIndex && *offset + reqs.size <= blocks[i].size) {
+			block = blocks + i;
+			break;
+		}
+	}
+	if (!block) {
+		block = newBlock(typeIndex, reqs.size);
+		*offset = 0;
+	}
+	block->used = *offset + reqs.size;
+	return block;
+}
+
+void bindImage(VkImage img, uint32_t typeIndex, const char *name) {
+	VkMemoryRequirements reqs;
+	vkGetImageMemoryRequirements(dev, img, &reqs);
+	VkDeviceSize offset;
+	memBlock *block = subAllocate(reqs, typeIndex, name, &offset);
+	result = vkBindImageMemory(dev, img, block->mem, offset);
+	if (result != VK_SUCCESS) {
+		fprintf(stderr, "Failed to back %s with memory\n", name);
+		abort();
+	}
+}
+
+// Returns where the buffer is mapped, or NULL if its memory isn't host visible
+void *bindBuffer(VkBuffer buf, uint32_t typeIndex, const char *name) {
+	VkMemoryRequirements reqs;
+	vkGetBufferMemoryRequirements(dev, buf, &reqs);
+	VkDeviceSize offset;
+	memBlock *block = subAllocate(reqs, typeIndex, name, &offset);
+	result = vkBindBufferMemory(dev, buf, block->mem, offset);
+	if (result != VK_SUCCESS) {
+		fprintf(stderr, "Failed to back %s with memory\n", name);
+		abort();
+	}
+	return block->mapped ? (char*) block->mapped + offset : NULL;
+}
+
+void freeDeviceMemory() {
+	for (int i=0; i<blockCount; i++) {
+		if (blocks[i].mapped)
+			vkUnmapMemory(dev, blocks[i].mem);
+		vkFreeMemory(dev, blocks[i].mem, NULL);
+	}
+	blockCount = 0;
+}
@@ -0,0 +1,6 @@
+#include <vulkan/vulkan.h>
+
+void initDeviceMemory(VkPhysicalDevice physDev, VkDevice device);
+void bindImage(VkImage img, uint32_t typeIndex, const char *name);
+void *bindBuffer(VkBuffer buf, uint32_t typeIndex, const char *name);
+void freeDeviceMemory();
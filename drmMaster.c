@@ -11,18 +11,28 @@ drmModeResPtr res;
 drmModeConnectorPtr connector;
 drmModeCrtcPtr crtc;
 drmModeModeInfoPtr mode;
+// Connectors and crtcs already handed out, so every monitor gets its own
+static uint32_t takenConnectors[MAX_OUTPUTS], takenCrtcs[MAX_OUTPUTS];
+static int takenCount;
 
-static int getDrmLeaseFromX(int outputIndex);
+static int getDrmLeaseFromX(const int *outputIndices, int outputCount);
 
 void cleanUpDrmMaster() {
 	close(fd);
 }
 
-int getDrmMasterFd(int monitorIndex, int *isLeased) {
-	if (monitorIndex < 0) {
-		fprintf(stderr, "The monitor index must be at least 0");
+// Opens the card for all the monitors in monitorIndices, leasing them all together from X if needed
+int getDrmMasterFd(const int *monitorIndices, int monitorCount, int *isLeased) {
+	if (monitorCount < 1 || monitorCount > MAX_OUTPUTS) {
+		fprintf(stderr, "Can use 1 to %d monitors\n", MAX_OUTPUTS);
 		abort();
 	}
+	for (int i=0; i<monitorCount; i++) {
+		if (monitorIndices[i] < 0) {
+			fprintf(stderr, "The monitor index must be at least 0");
+			abort();
+		}
+	}
 
 	int cardNum = 0;
 	while (1) {
@@ -46,19 +56,19 @@ int getDrmMasterFd(int monitorIndex, int *isLeased) {
 	if (!drmIsMaster(fd)) {
 		*isLeased = 1;
 		close(fd);
-		fd = getDrmLeaseFromX(monitorIndex);
+		fd = getDrmLeaseFromX(monitorIndices, monitorCount);
 	}
 
 	return fd;
 }
 
-static int getDrmLeaseFromX(int outputIndex) {
+static int getDrmLeaseFromX(const int *outputIndices, int outputCount) {
 	static xcb_connection_t *c;
 	int leasefd;
 	xcb_window_t win;
 	xcb_randr_lease_t leaseId;
-	xcb_randr_output_t outputId;
-	xcb_randr_crtc_t crtcId;
+	xcb_randr_output_t outputIds[MAX_OUTPUTS];
+	xcb_randr_crtc_t crtcIds[MAX_OUTPUTS];
 
 	c = xcb_connect(NULL, NULL);
 	if (xcb_connection_has_error(c))
@@ -74,45 +84,78 @@ static int getDrmLeaseFromX(int outputIndex) {
 	xcb_randr_get_screen_resources_cookie_t resCookie = xcb_randr_get_screen_resources(c, win);
 	xcb_randr_get_screen_resources_reply_t *resources = xcb_randr_get_screen_resources_reply (c, resCookie, NULL);
 	int outputNum = xcb_randr_get_screen_resources_outputs_length(resources);
-	if (outputNum < outputIndex+1) {
-		fprintf(stderr, "There are only %d outputs, asked for output %d\n", outputNum, outputIndex+1);
-	}
-	if (outputIndex == 0)
-		outputId = xcb_randr_get_screen_resources_outputs(resources)[0];
-	else {
-		outputId = xcb_randr_get_screen_resources_outputs(resources)[outputIndex-1];
-	}
+	xcb_randr_output_t *outputs = xcb_randr_get_screen_resources_outputs(resources);
+	for (int k=0; k<outputCount; k++) {
+		int outputIndex = outputIndices[k];
+		if (outputNum < outputIndex) {
+			fprintf(stderr, "There are only %d outputs, asked for output %d\n", outputNum, outputIndex);
+			abort();
+		}
+		if (outputIndex == 0) {
+			if (outputNum <= k) {
+				fprintf(stderr, "There are only %d outputs, not enough for monitor %d\n", outputNum, k+1);
+				abort();
+			}
+			outputIds[k] = outputs[k];
+		} else {
+			outputIds[k] = outputs[outputIndex-1];
+		}
+		for (int j=0; j<k; j++) {
+			if (outputIds[j] == outputIds[k]) {
+				fprintf(stderr, "Monitors %d and %d would both use output %u\n", j+1, k+1, outputIds[k]);
+				abort();
+			}
+		}
 
-	// get crtc available to this output, make sure if we don't take the first output then don't take a crtc being used
-	xcb_randr_get_output_info_cookie_t outputCookie = xcb_randr_get_output_info(c, outputId, resources->config_timestamp);
-	xcb_randr_get_output_info_reply_t *outputReply = xcb_randr_get_output_info_reply(c, outputCookie, NULL);
-	if (outputIndex > 1) {
-		for (int i=0; i<xcb_randr_get_output_info_crtcs_length(outputReply); i++) {
-			crtcId = xcb_randr_get_output_info_crtcs(outputReply)[i];
-			xcb_randr_get_crtc_info_cookie_t crtcCookie = xcb_randr_get_crtc_info(c, crtcId, resources->config_timestamp);
-			xcb_randr_get_crtc_info_reply_t *crtcReply = xcb_randr_get_crtc_info_reply(c, crtcCookie, NULL);
-			if (crtcReply->width == 0 && crtcReply->height == 0) { // indicates crtc is unused
+		// get crtc available to this output, make sure if we don't take the first output then don't take a crtc being used,
+		// and never one already taken by another output of the lease
+		xcb_randr_get_output_info_cookie_t outputCookie = xcb_randr_get_output_info(c, outputIds[k], resources->config_timestamp);
+		xcb_randr_get_output_info_reply_t *outputReply = xcb_randr_get_output_info_reply(c, outputCookie, NULL);
+		int found = 0;
+		if (outputIndex > 1 || k > 0) {
+			for (int i=0; i<xcb_randr_get_output_info_crtcs_length(outputReply) && !found; i++) {
+				crtcIds[k] = xcb_randr_get_output_info_crtcs(outputReply)[i];
+				int taken = 0;
+				for (int j=0; j<k; j++)
+					taken |= crtcIds[j] == crtcIds[k];
+				if (taken)
+					continue;
+				xcb_randr_get_crtc_info_cookie_t crtcCookie = xcb_randr_get_crtc_info(c, crtcIds[k], resources->config_timestamp);
+				xcb_randr_get_crtc_info_reply_t *crtcReply = xcb_randr_get_crtc_info_reply(c, crtcCookie, NULL);
+				found = crtcReply->width == 0 && crtcReply->height == 0; // indicates crtc is unused
 				free(crtcReply);
-				break;
 			}
-			free(crtcReply);
+		} else if (xcb_randr_get_output_info_crtcs_length(outputReply) > 0) {
+			crtcIds[k] = xcb_randr_get_output_info_crtcs(outputReply)[0];
+			found = 1;
+		}
+		free(outputReply);
+		if (!found) {
+			fprintf(stderr, "No free CRTC for output %d\n", outputIndex);
+			abort();
 		}
-	} else {
-		crtcId = xcb_randr_get_output_info_crtcs(outputReply)[0];
 	}
 
 	// create lease having all parameters
-	xcb_randr_create_lease_cookie_t leaseCookie = xcb_randr_create_lease(c, win, leaseId, 1, 1, &crtcId, &outputId);
+	xcb_randr_create_lease_cookie_t leaseCookie = xcb_randr_create_lease(c, win, leaseId, outputCount, outputCount,
+										crtcIds, outputIds);
 	xcb_randr_create_lease_reply_t *reply = xcb_randr_create_lease_reply(c, leaseCookie, NULL);
 	leasefd = *xcb_randr_create_lease_reply_fds(c, reply);
 
 	free(resources);
-	free(outputReply);
 	free(reply);
 	xcb_disconnect(c);
 	return leasefd;
 }
 
+static int isTaken(uint32_t *taken, uint32_t id) {
+	for (int i=0; i<takenCount; i++) {
+		if (taken[i] == id)
+			return 1;
+	}
+	return 0;
+}
+
 void getCrtcFromCurrentConnector() {
 	// make sure it's connected
 	if (connector->connection != DRM_MODE_CONNECTED)
@@ -123,7 +166,7 @@ void getCrtcFromCurrentConnector() {
 	for (int j=0; j<connector->count_encoders; j++) {
 		drmModeEncoderPtr encoder = drmModeGetEncoder(fd, connector->encoders[j]);
 		for (int k=0; k<res->count_crtcs; k++) {
-			if (encoder->possible_crtcs && 1ul<<k) {
+			if (encoder->possible_crtcs & 1ul<<k && !isTaken(takenCrtcs, res->crtcs[k])) {
 				crtc = drmModeGetCrtc(fd, res->crtcs[k]);
 				drmModeFreeEncoder(encoder);
 				return;
@@ -133,11 +176,13 @@ void getCrtcFromCurrentConnector() {
 	}
 }
 
+// Every call takes a connector and crtc that no previous call took
 void getConnectorWithCrtc(int monitorIndex) {
 	connector = NULL;
 	crtc = NULL;
 
-	res = drmModeGetResources(fd);
+	if (res == NULL)
+		res = drmModeGetResources(fd);
 	if (res == NULL) {
 		fprintf(stderr, "Couldn't get resources from card %s\n", cardName);
 		abort();
@@ -146,17 +191,29 @@ void getConnectorWithCrtc(int monitorIndex) {
 	if (monitorIndex == 0) {
 		// Choose first available connector and a suitable crtc
 		for (int i=0; i<res->count_connectors; i++) {
+			if (isTaken(takenConnectors, res->connectors[i]))
+				continue;
 			connector = drmModeGetConnector(fd, res->connectors[i]);
 			getCrtcFromCurrentConnector();
 			if (crtc != NULL)
-				return;
+				break;
 		}
 	} else {
 		if (monitorIndex > res->count_connectors) {
 			fprintf(stderr, "There aren't enough monitors, choose a lower index\n");
 			abort();
 		}
+		if (isTaken(takenConnectors, res->connectors[monitorIndex-1])) {
+			fprintf(stderr, "Monitor index %d is already used by another monitor\n", monitorIndex);
+			abort();
+		}
 		connector = drmModeGetConnector(fd, res->connectors[monitorIndex-1]);
 		getCrtcFromCurrentConnector();
 	}
+
+	if (crtc != NULL && takenCount < MAX_OUTPUTS) {
+		takenConnectors[takenCount] = connector->connector_id;
+		takenCrtcs[takenCount] = crtc->crtc_id;
+		takenCount++;
+	}
 }
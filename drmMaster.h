@@ -3,6 +3,9 @@
 #include <xcb/xcb.h>
 #include <xcb/randr.h>
 
+// Most monitors a single process can span
+#define MAX_OUTPUTS 8
+
 extern char cardName[];
 extern drmModeResPtr res;
 extern drmModeConnectorPtr connector;
@@ -10,6 +13,6 @@ extern drmModeCrtcPtr crtc;
 extern drmModeModeInfoPtr mode;
 
 void cleanUpDrmMaster();
-int getDrmMasterFd(int monitorIndex, int *isLeased);
+int getDrmMasterFd(const int *monitorIndices, int monitorCount, int *isLeased);
 void getCrtcFromCurrentConnector();
 void getConnectorWithCrtc(int monitorIndex);
@@ -4,10 +4,24 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 
-uint32_t *frontBuf, *backBuf;
-unsigned int xSize, ySize;
+// One being drawn by the simulation thread, one finished and waiting in the handoff slot,
+// one on screen and one with a page flip scheduled
+#define BUFFER_COUNT 4
+// Set in latestFrame when the buffer in the slot hasn't been picked up by the present thread yet
+#define FRESH_FRAME 0x100
+
+// The outputs show side by side slices of one screenXSize by screenYSize frame.
+// backBufs[i] is the part of the frame being drawn that goes to output i
+int outputCount;
+uint32_t *backBufs[MAX_OUTPUTS];
+unsigned int outputXSizes[MAX_OUTPUTS], outputYSizes[MAX_OUTPUTS], outputXOffsets[MAX_OUTPUTS];
+unsigned int screenXSize, screenYSize;
 
 static int fd;
 /*
@@ -16,18 +30,57 @@ static drmModeConnectorPtr connector;
 static drmModeCrtcPtr crtc;
 static drmModeModeInfoPtr mode;
 */
-static uint32_t frontBufId, backBufId;
+// Buffer i of every output together make frame i, so a single index tracks a frame on all outputs
+typedef struct {
+	drmModeConnectorPtr connector;
+	drmModeCrtcPtr crtc;
+	drmModeModeInfoPtr mode;
+	uint32_t *bufs[BUFFER_COUNT];
+	uint32_t bufIds[BUFFER_COUNT];
+	uint64_t bufSize;
+	unsigned int lastSequence; // vblank count of the last flip, 0 before the first one
+} output;
+static output outputs[MAX_OUTPUTS];
+
+// Indices into bufs, owned by the present thread. frontIndex is being scanned out, flipIndex has
+// a page flip scheduled for the next vblank and spareIndex is the one it can give back to the
+// simulation thread. -1 means there is no such buffer right now
+static int frontIndex, flipIndex = -1, spareIndex = -1;
+// Outputs that haven't flipped to flipIndex yet, the frame is only on screen once they all did
+static int pendingFlips;
+// Owned by the simulation thread, the buffers backBufs point to
+static int backIndex;
+// Single producer, single consumer handoff slot between both threads, always holds a buffer index.
+// The simulation thread swaps its finished buffer in, the present thread swaps its spare in
+static atomic_int latestFrame;
+static int frameEventFd; // wakes up the present thread when a frame is published
+static atomic_int presenting;
+static pthread_t presentThread;
+// Vblanks an output went through without flipping since the one before, read by the simulation thread. They
+// aren't all missed: most of the time no new frame was ready yet
+atomic_uint staleVblanks;
 
-static uint64_t dumbBuffersSize;
+static void pageFlipHandler(int drmFd, unsigned int sequence, unsigned int tvSec, unsigned int tvUsec, void *userData);
+static drmEventContext eventContext = {
+	.version = 2,
+	.page_flip_handler = pageFlipHandler,
+};
 
 void cleanUpDumbBuffers() {
-	drmModeFreeResources(res);
-	//drmModeFreeConnector(connector); gets freed somewhere else?
-	drmModeFreeCrtc(crtc);
-	drmModeFreeModeInfo(mode);
+	if (atomic_exchange(&presenting, 0)) {
+		uint64_t wake = 1;
+		write(frameEventFd, &wake, sizeof(wake));
+		pthread_join(presentThread, NULL);
+	}
+	close(frameEventFd);
 
-	munmap(frontBuf, dumbBuffersSize);
-	munmap(backBuf, dumbBuffersSize);
+	drmModeFreeResources(res);
+	for (int i=0; i<outputCount; i++) {
+		//drmModeFreeConnector(connector); gets freed somewhere else?
+		drmModeFreeCrtc(outputs[i].crtc);
+		for (int j=0; j<BUFFER_COUNT; j++)
+			munmap(outputs[i].bufs[j], outputs[i].bufSize);
+	}
 	cleanUpDrmMaster();
 }
 
@@ -75,60 +128,151 @@ static void getConnectorWithCrtc(int monitorIndex) {
 }
 */
 
-static void getDumbBuffersFromKMS(int monitorIndex) {
+static void getDumbBuffersFromKMS(int monitorIndex, output *out) {
 	getConnectorWithCrtc(monitorIndex);
 	if (crtc == NULL) {
 		fprintf(stderr, "Couldn't find a suitable crtc for the given connector, or any connector\n");
 		abort();
 	}
+	out->connector = connector;
+	out->crtc = crtc;
+	out->mode = connector->modes; // First mode should be the best
+	unsigned int width = out->mode->hdisplay, height = out->mode->vdisplay;
 
-	mode = connector->modes; // First mode should be the best
-	xSize = mode->hdisplay;
-	ySize = mode->vdisplay;
-
-	// create 2 buffers for page flipping
+	// create the buffers for page flipping
 	uint32_t handle, pitch;
 	uint64_t offset;
-	drmModeCreateDumbBuffer(fd, xSize, ySize, 32, 0, &handle, &pitch, &dumbBuffersSize);
-	drmModeMapDumbBuffer(fd, handle, &offset);
-	drmModeAddFB(fd, xSize, ySize, 24, 32, pitch, handle, &frontBufId);
-	frontBuf = mmap(NULL, dumbBuffersSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
-	
-	drmModeCreateDumbBuffer(fd, xSize, ySize, 32, 0, &handle, &pitch, &dumbBuffersSize);
-	drmModeMapDumbBuffer(fd, handle, &offset);
-	drmModeAddFB(fd, xSize, ySize, 24, 32, pitch, handle, &backBufId);
-	backBuf = mmap(NULL, dumbBuffersSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
-
-	drmModeSetCrtc(fd, crtc->crtc_id, frontBufId, 0, 0, &(connector->connector_id), 1, mode);
+	for (int i=0; i<BUFFER_COUNT; i++) {
+		drmModeCreateDumbBuffer(fd, width, height, 32, 0, &handle, &pitch, &out->bufSize);
+		drmModeMapDumbBuffer(fd, handle, &offset);
+		drmModeAddFB(fd, width, height, 24, 32, pitch, handle, out->bufIds + i);
+		out->bufs[i] = mmap(NULL, out->bufSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+		if (out->bufs[i] == MAP_FAILED) {
+			fprintf(stderr, "Couldn't map dumb buffer %d\n", i);
+			abort();
+		}
+	}
+}
+
+static void pageFlipHandler(int drmFd, unsigned int sequence, unsigned int tvSec, unsigned int tvUsec, void *userData) {
+	(void) drmFd;
+	(void) tvSec;
+	(void) tvUsec;
+	// A gap in the vblank count of an output means it kept showing the old frame over those vblanks
+	output *out = userData;
+	if (out->lastSequence && sequence - out->lastSequence > 1)
+		atomic_fetch_add_explicit(&staleVblanks, sequence - out->lastSequence - 1, memory_order_relaxed);
+	out->lastSequence = sequence;
+
+	// The flipped buffer is now on screen everywhere, so the old front buffer can be handed out again
+	if (--pendingFlips)
+		return;
+	spareIndex = frontIndex;
+	frontIndex = flipIndex;
+	flipIndex = -1;
+}
+
+static void scheduleFlip(int index) {
+	// doesn't flip immediately, only schedules to flip at next vblank and sends an event when done.
+	// Every crtc flips at its own vblank, the frame counts as flipped when the last one did
+	for (int i=0; i<outputCount; i++) {
+		if (drmModePageFlip(fd, outputs[i].crtc->crtc_id, outputs[i].bufIds[index], DRM_MODE_PAGE_FLIP_EVENT, outputs + i)) {
+			fprintf(stderr, "Couldn't schedule a page flip\n");
+			abort();
+		}
+	}
+	pendingFlips = outputCount;
+	flipIndex = index;
+}
+
+// Present thread: the only one touching the DRM fd after setup. Whenever there's no flip pending
+// and the simulation thread has published a frame, take it from the slot and schedule it
+static void *presentLoop(void *arg) {
+	(void) arg;
+	struct pollfd pfds[2];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = frameEventFd;
+	pfds[1].events = POLLIN;
+
+	while (atomic_load(&presenting)) {
+		if (poll(pfds, 2, -1) <= 0)
+			continue;
+		if (pfds[0].revents & POLLIN)
+			drmHandleEvent(fd, &eventContext);
+		if (pfds[1].revents & POLLIN) {
+			uint64_t published;
+			read(frameEventFd, &published, sizeof(published));
+		}
+
+		if (flipIndex == -1 && (atomic_load_explicit(&latestFrame, memory_order_relaxed) & FRESH_FRAME)) {
+			int frame = atomic_exchange_explicit(&latestFrame, spareIndex, memory_order_acq_rel);
+			spareIndex = -1;
+			scheduleFlip(frame & ~FRESH_FRAME);
+		}
+	}
+	return NULL;
+}
+
+static void setBackBufs() {
+	for (int i=0; i<outputCount; i++)
+		backBufs[i] = outputs[i].bufs[backIndex];
 }
 
 // Functions exposed in the header file
 // monitorIndex > 1 asks for monitorIndex-1th monitor
 // monitorIndex == 0 asks for first available monitor it finds
-void getDumbBuffers(int monitorIndex) {
+// The monitors are laid out left to right in the order of monitorIndices
+void getDumbBuffers(const int *monitorIndices, int monitorCount) {
 	int isLeased;
 
-	fd = getDrmMasterFd(monitorIndex, &isLeased);
-	if (isLeased) {
-		getDumbBuffersFromKMS(0);
-	} else
-		getDumbBuffersFromKMS(monitorIndex);
-}
+	fd = getDrmMasterFd(monitorIndices, monitorCount, &isLeased);
+	outputCount = monitorCount;
+	screenXSize = 0;
+	screenYSize = 0;
+	for (int i=0; i<outputCount; i++) {
+		// A lease only has the leased connectors, so take them in order
+		getDumbBuffersFromKMS(isLeased ? 0 : monitorIndices[i], outputs + i);
+		outputXSizes[i] = outputs[i].mode->hdisplay;
+		outputYSizes[i] = outputs[i].mode->vdisplay;
+		outputXOffsets[i] = screenXSize;
+		screenXSize += outputXSizes[i];
+		if (outputYSizes[i] > screenYSize)
+			screenYSize = outputYSizes[i];
+	}
 
-void waitVBlankAndSwapBuffers() {
-	// doesn't flip immediately, only schedules to flip at next vblank
-	drmModePageFlip(fd, crtc->crtc_id, backBufId, 0, NULL);
+	frontIndex = 0;
+	spareIndex = 1;
+	atomic_store(&latestFrame, 2);
+	backIndex = 3;
+	setBackBufs();
+	for (int i=0; i<outputCount; i++) {
+		drmModeSetCrtc(fd, outputs[i].crtc->crtc_id, outputs[i].bufIds[frontIndex], 0, 0,
+				&outputs[i].connector->connector_id, 1, outputs[i].mode);
+	}
+}
 
-	drmVBlank vblank;
-	vblank.request.type = DRM_VBLANK_RELATIVE;
-	vblank.request.sequence = 1;
-	drmWaitVBlank(fd, &vblank);
+void startPresentThread() {
+	frameEventFd = eventfd(0, EFD_NONBLOCK);
+	if (frameEventFd < 0) {
+		fprintf(stderr, "Couldn't create the frame event fd\n");
+		abort();
+	}
+	atomic_store(&presenting, 1);
+	if (pthread_create(&presentThread, NULL, presentLoop, NULL)) {
+		fprintf(stderr, "Couldn't create the present thread\n");
+		abort();
+	}
+}
 
+// Called by the simulation thread when backBufs hold a complete frame. Never blocks: the frame
+// replaces whatever was in the slot, so the present thread always flips to the latest one, and
+// backBufs are pointed to the buffers that were there before
+void publishFrame() {
+	int previous = atomic_exchange_explicit(&latestFrame, backIndex | FRESH_FRAME, memory_order_acq_rel);
+	backIndex = previous & ~FRESH_FRAME;
+	setBackBufs();
 
-	uint32_t temp = frontBufId;
-	frontBufId = backBufId;
-	backBufId = temp;
-	uint32_t *tempPtr = frontBuf;
-	frontBuf = backBuf;
-	backBuf = tempPtr;
+	uint64_t published = 1;
+	write(frameEventFd, &published, sizeof(published));
 }
@@ -2,10 +2,17 @@
 #include <xf86drmMode.h>
 #include <xcb/xcb.h>
 #include <xcb/randr.h>
+#include <stdatomic.h>
 
-extern uint32_t *frontBuf, *backBuf;
-extern unsigned int xSize, ySize;
+#include "drmMaster.h"
 
-void getDumbBuffers(int monitorIndex);
-void waitVBlankAndSwapBuffers();
+extern int outputCount;
+extern uint32_t *backBufs[MAX_OUTPUTS];
+extern unsigned int outputXSizes[MAX_OUTPUTS], outputYSizes[MAX_OUTPUTS], outputXOffsets[MAX_OUTPUTS];
+extern unsigned int screenXSize, screenYSize;
+extern atomic_uint staleVblanks;
+
+void getDumbBuffers(const int *monitorIndices, int monitorCount);
+void startPresentThread();
+void publishFrame();
 void cleanUpDumbBuffers();
@@ -0,0 +1,59 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "hostMemory.h"
+
+// CPU simulation buffers are mapped in whole 2 MiB huge pages, explicit ones if any are reserved
+// and transparent ones otherwise. Nothing is touched here: pages land on the NUMA node of
+// whichever thread writes them first, so the workers owning each part should be the first ones
+#define HUGE_PAGE_SIZE (2ul << 20)
+#define MAX_HOST_BUFFERS 16
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+typedef struct {
+	void *addr;
+	size_t size;
+} hostBuffer;
+
+static hostBuffer buffers[MAX_HOST_BUFFERS];
+static int bufferCount;
+
+void *allocHostBuffer(size_t size, const char *name) {
+	if (bufferCount == MAX_HOST_BUFFERS) {
+		fprintf(stderr, "Too many host buffers to allocate %s\n", name);
+		abort();
+	}
+	size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+	void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+	if (addr == MAP_FAILED) {
+		// No reserved huge pages, map a bit more to cut out a range aligned for transparent ones
+		size_t padded = size + HUGE_PAGE_SIZE;
+		char *raw = mmap(NULL, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == MAP_FAILED) {
+			fprintf(stderr, "Couldn't map %s\n", name);
+			abort();
+		}
+		char *aligned = (char*) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+		if (aligned != raw)
+			munmap(raw, aligned - raw);
+		if (aligned + size != raw + padded)
+			munmap(aligned + size, raw + padded - (aligned + size));
+		addr = aligned;
+		madvise(addr, size, MADV_HUGEPAGE); // only a hint, fine if THP is disabled
+	}
+
+	buffers[bufferCount].addr = addr;
+	buffers[bufferCount].size = size;
+	bufferCount++;
+	return addr;
+}
+
+void freeHostBuffers() {
+	for (int i=0; i<bufferCount; i++)
+		munmap(buffers[i].addr, buffers[i].size);
+	bufferCount = 0;
+}
@@ -0,0 +1,4 @@
+#include <stddef.h>
+
+void *allocHostBuffer(size_t size, const char *name);
+void freeHostBuffers();
@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "workers.h"
+#include "perfCounters.h"
+
+// Every worker counts its own thread, in user space only so it works with perf_event_paranoid up to 2.
+// Counters the kernel multiplexes are scaled up by how long they actually ran in each interval
+const char *perfCounterNames[PERF_COUNTERS] = {"cycles", "instructions", "LLC misses", "dTLB misses", "branch misses"};
+int perfCounterAvailable[PERF_COUNTERS];
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} events[PERF_COUNTERS] = {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+				PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+static int fds[MAX_WORKERS][PERF_COUNTERS];
+static int openWorkers;
+
+static void openOnWorker(int worker, void *arg) {
+	(void) arg;
+	for (int i=0; i<PERF_COUNTERS; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		fds[worker][i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+}
+
+// On the workers started so far. A counter is available when every worker could open it. Returns how many are,
+// 0 when there are no hardware counters at all, as in most containers and VMs
+int openPerfCounters() {
+	openWorkers = workerCount;
+	runOnWorkers(openOnWorker, NULL);
+	int available = 0;
+	for (int i=0; i<PERF_COUNTERS; i++) {
+		perfCounterAvailable[i] = 1;
+		for (int w=0; w<openWorkers; w++)
+			perfCounterAvailable[i] &= fds[w][i] >= 0;
+		available += perfCounterAvailable[i];
+	}
+	return available;
+}
+
+// Raw values since the counters were opened, 0 for the ones that aren't available
+void readPerfCounters(perfReading *reading) {
+	for (int w=0; w<openWorkers; w++) {
+		for (int i=0; i<PERF_COUNTERS; i++) {
+			uint64_t *value = reading->values[w][i]; // count, time enabled, time running
+			if (!perfCounterAvailable[i] || read(fds[w][i], value, 3 * sizeof(uint64_t)) != 3 * sizeof(uint64_t))
+				memset(value, 0, 3 * sizeof(uint64_t));
+		}
+	}
+}
+
+// Totals over the workers from start to end. Each worker's count is scaled by how long its counter was enabled
+// against how long it ran between the two, so a change in multiplexing since opening doesn't skew it
+void perfCountsBetween(const perfReading *start, const perfReading *end, uint64_t counts[PERF_COUNTERS]) {
+	for (int i=0; i<PERF_COUNTERS; i++) {
+		counts[i] = 0;
+		for (int w=0; w<openWorkers; w++) {
+			uint64_t count = end->values[w][i][0] - start->values[w][i][0];
+			uint64_t enabled = end->values[w][i][1] - start->values[w][i][1];
+			uint64_t running = end->values[w][i][2] - start->values[w][i][2];
+			if (!running)
+				continue;
+			counts[i] += running == enabled ? count : (uint64_t) ((double) count * enabled / running);
+		}
+	}
+}
+
+void closePerfCounters() {
+	for (int w=0; w<openWorkers; w++) {
+		for (int i=0; i<PERF_COUNTERS; i++) {
+			if (fds[w][i] >= 0)
+				close(fds[w][i]);
+		}
+	}
+	openWorkers = 0;
+}
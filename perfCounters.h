@@ -0,0 +1,25 @@
+#include <stdint.h>
+
+// Hardware counters of every worker thread, see openPerfCounters()
+enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_LLC_MISSES,
+	PERF_DTLB_MISSES, // data loads
+	PERF_BRANCH_MISSES,
+	PERF_COUNTERS
+};
+
+extern const char *perfCounterNames[PERF_COUNTERS];
+extern int perfCounterAvailable[PERF_COUNTERS];
+
+// Count, time enabled and time running of every counter of every worker at one point, see perfCountsBetween().
+// Needs MAX_WORKERS from workers.h
+typedef struct {
+	uint64_t values[MAX_WORKERS][PERF_COUNTERS][3];
+} perfReading;
+
+int openPerfCounters();
+void readPerfCounters(perfReading *reading);
+void perfCountsBetween(const perfReading *start, const perfReading *end, uint64_t counts[PERF_COUNTERS]);
+void closePerfCounters();
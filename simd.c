@@ -0,0 +1,32 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "simd.h"
+
+int simdLevel = SIMD_SSE2;
+const char *simdNames[SIMD_LEVELS] = {"sse2", "avx2", "avx512"};
+
+// SLIME_SIMD=sse2, avx2 or avx512 forces a level, to compare them in bench
+void selectSimd() {
+	__builtin_cpu_init();
+	int best = SIMD_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		best = SIMD_AVX2;
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		best = SIMD_AVX512;
+	simdLevel = best;
+
+	const char *forced = getenv("SLIME_SIMD");
+	if (forced) {
+		for (simdLevel=0; simdLevel<SIMD_LEVELS && strcmp(forced, simdNames[simdLevel]); simdLevel++);
+		if (simdLevel == SIMD_LEVELS) {
+			fprintf(stderr, "SLIME_SIMD should be sse2, avx2 or avx512\n");
+			exit(1);
+		}
+		if (simdLevel > best) {
+			fprintf(stderr, "This CPU doesn't have %s\n", forced);
+			exit(1);
+		}
+	}
+	printf("Using %s kernels\n", simdNames[simdLevel]);
+}
@@ -0,0 +1,22 @@
+// The hot CPU kernels are compiled for every one of these levels, and the best one the CPU has is used. The build
+// itself only assumes SSE2, so the same binary runs on any x86-64. Keep the global buffers and settings a kernel uses
+// in restrict locals, or the compiler has to assume its stores change them and won't vectorize it. Before adding
+// variants of a kernel, check with -fopt-info-vec that it vectorizes and with objdump that its AVX2 and AVX-512
+// ones use ymm and zmm registers
+enum {SIMD_SSE2, SIMD_AVX2, SIMD_AVX512, SIMD_LEVELS};
+
+extern int simdLevel;
+extern const char *simdNames[SIMD_LEVELS];
+
+void selectSimd();
+
+// Declares name##Body, a function taking params that has to be defined after it, and defines name##Variants,
+// it compiled for every level in the order of the enum. args passes params on to it
+#define SIMD_VARIANTS(name, params, args) \
+	static inline void name##Body params __attribute__((always_inline)); \
+	__attribute__((target("sse2"))) static void name##Sse2 params { name##Body args; } \
+	__attribute__((target("avx2"))) static void name##Avx2 params { name##Body args; } \
+	__attribute__((target("avx512f,avx512bw,prefer-vector-width=512"))) static void name##Avx512 params { \
+		name##Body args; \
+	} \
+	void (*const name##Variants[SIMD_LEVELS]) params = {name##Sse2, name##Avx2, name##Avx512};
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -12,24 +13,81 @@
 #include <signal.h>
 #include "dumbBuffers.h"
 #include "vulkanSetup.h"
+#include "hostMemory.h"
+#include "workers.h"
+#include "telemetry.h"
+#include "checkpoint.h"
+#include "simd.h"
+#include "perfCounters.h"
 
 /*
  * VARIABLES TO MODIFY BEHAVIOR AT COMPILE TIME GO HERE
  */
 int useVulkan = 1;
-const int monitorIndex = 0; // Maybe make it command line option later
+// Monitors the simulation spans, left to right. Each index is as described in getDumbBuffers
+const int monitorIndices[] = {0}; // Maybe make it command line option later
+const int monitorCount = sizeof(monitorIndices) / sizeof(monitorIndices[0]);
 const int particleCount = 200000;
+const int cpuThreads = 0; // Threads the CPU simulation runs on, 0 uses every CPU
+const int substeps = 1; // Simulation steps per displayed frame, all submitted together with Vulkan
+// CPU with diffusionMode 0: blur and fade diffusionBlock substeps at once, tile by tile in cache, instead of going
+// through the whole trail for every one. This is an approximation: particles move all those steps sensing the trail
+// as it was before them, without their own deposits or the diffusion of the earlier steps, though the deposits still
+// land in the step they were made in. So results change with it, and compare mode always runs without it. 1, the
+// default, turns it off, at most MAX_DIFFUSION_BLOCK
+const int diffusionBlock = 1;
+// CPU with diffusionMode 0 and diffusionBlock 1: particles move while the trail blurs and fades instead of after
+// it, sensing the trail as it was before the step, and their deposits are merged once both are done
+const int concurrentStages = 0;
+// Vulkan: make frames only of compute dispatches and the copy to the swapchain, all in one submission
+const int computeOnlyFrames = 0;
+// Size the simulation runs at, scaled with filtering to the display when they differ.
+// Sizes of 0 mean the display size times simulationScale
+const unsigned int simulationWidth = 0, simulationHeight = 0;
+const double simulationScale = 1.0;
+// Particles sense the average of a 2^sensorLevel pixels wide square instead of a single pixel, read from
+// a mip chain of the trail map so it costs the same at any size. 0 senses single pixels
+const int sensorLevel = 0;
 double particleSpeed = 5.0; // distance traveled per frame
+// Where particles start: 0 anywhere in the middle half of the screen, 1 in a disc and 2 on a ring, facing its center
+const int spawnLayout = 0;
 double steerAmplitude = M_PI * 0.16; // Angle of field of vision of particle and how much it steers in one frame
 int steerLength = 25; // How many steps away to look for pixels to steer towards
 double maxRandRadianChange = M_PI * 0.08; // Maximum random change of angle (in radians) per frame on top of the steering
 uint32_t particleColor = 0x0060FFE0; // XRGB
 uint8_t redFade = 0x1, greenFade = 0x3, blueFade = 0x1; // change these to get different effects
-const unsigned int blurKernel[9] = {4, 2, 4, // can be not const, but blur is the bottleneck and it makes a bit of a difference
+// SLIME_KERNEL="a,b,c,d,e,f,g,h,i" in the environment replaces it at startup, and blurDivide with its sum.
+// The CPU blur uses the most specialized implementation that fits it, see blurKernelClasses
+unsigned int blurKernel[9] = {4, 2, 4,
 				2, 1, 2,
 				4, 2, 4};
 unsigned int blurDivide = 25; // should be set to the sum of elements of blurkernel
+// 0 diffuses with blurKernel, 1 with a box blur of side 2*boxRadius+1 and 2 with boxIterations box blurs in a row,
+// which is close to a gaussian blur. Box blurs use summed-area tables, so any radius costs the same
+const int diffusionMode = 0;
+const int boxRadius = 4;
+const int boxIterations = 3;
+// Vulkan with diffusionMode 0: blur and fade only the 16x16 tiles where particles or trails are and their
+// neighbors, with a compute dispatch sized on the GPU. Sparse trails then cost a fraction of a full blur
+const int activeTiles = 0;
+// CPU only: 1 makes the world wrap around. Particles leaving an edge come back in at the other one, and sense
+// and blur across it. Needs diffusionMode 0, box blurs stop at the edges
+const int wrapEdges = 0;
 unsigned int vkRandSeed;
+// ./output compare <frames> [snapshot] (make compare) runs both backends headless from the same particles and compares
+// their results, see compareBackends(). Random steering is turned off, it would make them diverge right away
+const unsigned int compareWidth = 256, compareHeight = 256;
+const int compareParticleCount = 4096;
+const unsigned int compareSeed = 1;
+const double trailTolerance = 4.0; // largest mean difference of trail channels, out of 255
+const double particleTolerance = 0.05; // largest fraction of particles more than a pixel away from the other backend's
+// ./output bench (make bench) times every CPU kernel on its own over synthetic inputs, see benchKernels().
+// ./output bench perf also reads hardware counters over whole frames, see profileStages()
+const int benchWarmups = 3, benchRepetitions = 25;
+// The particles and trails are saved here every checkpointSeconds and on SIGINT, and the simulation resumes
+// from them on startup if the backend, size and particle count match. NULL turns checkpoints off
+const char *checkpointPath = "slime.ckp";
+const int checkpointSeconds = 60;
 /*
  *
  */
@@ -39,7 +97,7 @@ const int particlesPerInvocation = 1;
 const int particlesPerGroup = particlesPerInvocation * localGroupSize;
 
 
-#define pixel(x, y) ((y)*xSize + (x))
+#define pixel(x, y) ((y)*trailStride + (x))
 #define min(x, y) ({ \
 	__typeof__ (x) x2 = (x); \
 	__typeof__ (y) y2 = (y); \
@@ -60,31 +118,1179 @@ typedef struct {
 	double posX, posY, dirX, dirY, angle;
 } particle;
 particle *particles;
-uint32_t *tempBuf1, *tempBuf2; // copying from frontBuf to backBuf is slower than from a usual tempBuf to backBuf (why?)
+unsigned int xSize, ySize; // CPU simulation size
+int simParticleCount; // particleCount, except in compare and bench mode
+int simDiffusionBlock; // diffusionBlock, except in compare mode
+// Trail rows are trailStride bytes apart, and every row starts TRAIL_MARGIN bytes into its stride so they're all
+// aligned for vector loads. The image is surrounded by a halo a pixel wide, see refreshHalo()
+#define TRAIL_MARGIN 64
+unsigned int trailStride;
+// For every screen column and row the first simulation column or row it's filtered from and the weight of the next
+unsigned int *scaleX0, *scaleWX, *scaleY0, *scaleWY;
+uint8_t *tempBuf1, *tempBuf2; // trail intensities, only colored through palette when copied to the screen
+uint8_t *sensedTrail; // the one particles sense, tempBuf2 when they move during the diffusion
+uint32_t palette[256]; // XRGB color of every intensity, see buildPalette()
+double paletteLuma[256]; // what particles sense of every intensity, the luma of its color
+int intensityFade; // intensity lost every step
+// Trails are processed in TILE_SIZE pixels wide squares. A 0 in the activity map of a buffer means the tile is
+// black there, so blur() only computes tiles next to active ones and fade() skips black ones
+#define TILE_SIZE 32
+unsigned char *tiles1, *tiles2; // activity maps of tempBuf1 and tempBuf2, swapped along with them
+unsigned int tilesX, tilesY;
+// Diffusing several steps at once, see diffuseBlock(). Steps can't reach further than a tile
+#define MAX_DIFFUSION_BLOCK 8
+#define BLOCK_SIDE (TILE_SIZE + 2*MAX_DIFFUSION_BLOCK)
+// Deposits of every step of the block, x | y << 16 sorted by tile. Tile t of step s has the ones from
+// depositStarts[s*(tiles+1) + t] to depositStarts[s*(tiles+1) + t+1]
+uint32_t *blockDeposits, *depositStarts;
+int blockSteps; // steps of the block being diffused
+int blockDefaultKernel; // whether blurKernel is the default one, folded into blockStep()
+const unsigned int defaultBlurKernel[9] = {4, 2, 4, 2, 1, 2, 4, 2, 4};
+// Implementations of the blur, see blurKernelClasses. They blur rows y0 to y1 and columns x0 to x1 of tempBuf2
+// into tempBuf1, reading the halo at the edges
+typedef void (*blurCenterFunc)(unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1);
+#define BLUR_CENTER_VARIANTS(name) \
+	SIMD_VARIANTS(name, (unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1), (x0, x1, y0, y1))
+typedef struct {
+	const char *name;
+	int (*fits)(); // whether it works for blurKernel
+	blurCenterFunc blurCenter;
+	const blurCenterFunc *simdBlurCenter; // one for every SIMD level instead, for the ones that vectorize
+} blurKernelClass;
+blurCenterFunc blurCenter;
+extern const blurKernelClass blurKernelClasses[];
+extern const int blurKernelClassCount;
+blurCenterFunc classBlurCenter(const blurKernelClass *kernelClass);
+uint32_t *satTable; // summed-area table of tempBuf2, only used when diffusionMode isn't 0
+float *sensorMap; // paletteLuma of sensedTrail averaged over 2^sensorLevel wide squares, only used when sensorLevel > 0
+unsigned int sensorXSize, sensorYSize;
+// The particles are moved in MOVE_PARTS_PER_WORKER parts per worker, each with its own rand_r() state so they
+// move the same whichever worker moves them. On their own cache lines so they aren't shared between cores
+#define MOVE_PARTS_PER_WORKER 4
+typedef struct {
+	unsigned int state;
+} __attribute__((aligned(64))) rngState;
+rngState rngStates[MAX_WORKERS * MOVE_PARTS_PER_WORKER];
+telemetryRecord frameTelemetry; // timings of the frame being simulated, published once it's done
+unsigned long long stageStart; // when the current CPU stage of draw() started, see endStage()
+// Hardware counts of every CPU stage of draw() while profiling, summed over the frames
+int profiling;
+uint64_t stageCounts[STAGE_COUNT][PERF_COUNTERS];
+perfReading stageStartReading;
+volatile sig_atomic_t quitRequested; // set by SIGINT while the frame loop runs, it quits after the frame
+int frameLoopRunning;
 
 unsigned long long getMicros();
-void draw(uint32_t *buf);
+void draw();
 void genParticle(particle *p);
+void firstTouch(int worker, void *arg);
+void buildPalette();
+void selectBlurKernel();
+void readBlurKernel();
+void setTileGrid();
+void markAllTiles();
+void blur();
+void boxBlur();
+void fade();
+void moveParticles();
+void moveParticlesBlock(int steps);
+void diffuseBlock(int steps);
+void copyToScreen();
+void getScaleWeights(unsigned int *first, unsigned int *weight, unsigned int screenCount, unsigned int simCount);
 
-// SIGINT is the normal way this program terminates, so make sure atexit() functions can clean up
+// SIGINT is the normal way this program terminates, so make sure atexit() functions can clean up.
+// The frame loop gets to finish its frame and save a checkpoint first, unless it's interrupted twice
 void sigintHandler(int _) {
-	exit(0);
+	if (!frameLoopRunning || quitRequested)
+		exit(0);
+	quitRequested = 1;
 }
 
 void cleanUpOtherBuffers() {
-	free(particles);
-	free(tempBuf1);
-	free(tempBuf2);
+	stopWorkers();
+	freeHostBuffers(); // particles, tempBuf1 and tempBuf2
+	free(sensorMap);
+	free(satTable);
+	free(blockDeposits);
+	free(depositStarts);
+	free(tiles1);
+	free(tiles2);
+	free(scaleX0);
+	free(scaleWX);
+	free(scaleY0);
+	free(scaleWY);
+}
+
+// Fills mip levels 1 to sensorLevel of img from level 0, each one a blit of the previous one
+void recordMipChain(VkCommandBuffer cmdBuf, VkImage img) {
+	VkMemoryBarrier memBarrier;
+	memBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	memBarrier.pNext = NULL;
+	memBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+				VK_ACCESS_TRANSFER_WRITE_BIT;
+	memBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+
+	VkImageBlit blit;
+	blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	blit.srcSubresource.baseArrayLayer = 0;
+	blit.srcSubresource.layerCount = 1;
+	blit.dstSubresource = blit.srcSubresource;
+	blit.srcOffsets[0].x = 0;
+	blit.srcOffsets[0].y = 0;
+	blit.srcOffsets[0].z = 0;
+	blit.dstOffsets[0] = blit.srcOffsets[0];
+
+	for (int level=1; level<=sensorLevel; level++) {
+		vkCmdPipelineBarrier(cmdBuf,
+					VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+					VK_PIPELINE_STAGE_TRANSFER_BIT,
+					VK_PIPELINE_STAGE_TRANSFER_BIT,
+					0, 1, &memBarrier, 0, NULL, 0, NULL);
+		blit.srcSubresource.mipLevel = level-1;
+		blit.srcOffsets[1].x = max(1u, simWidth >> (level-1));
+		blit.srcOffsets[1].y = max(1u, simHeight >> (level-1));
+		blit.srcOffsets[1].z = 1;
+		blit.dstSubresource.mipLevel = level;
+		blit.dstOffsets[1].x = max(1u, simWidth >> level);
+		blit.dstOffsets[1].y = max(1u, simHeight >> level);
+		blit.dstOffsets[1].z = 1;
+		vkCmdBlitImage(cmdBuf, img, VK_IMAGE_LAYOUT_GENERAL, img, VK_IMAGE_LAYOUT_GENERAL, 1, &blit, VK_FILTER_LINEAR);
+	}
+}
+
+// Box blurs the image with the latest result, in place. Every pass is a prefix sum over rows,
+// one over columns and then box averages, each its own dispatch since they depend on the whole previous one
+void recordBoxBlur(VkCommandBuffer cmdBuf, VkDescriptorSet set) {
+	VkMemoryBarrier memBarrier;
+	memBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	memBarrier.pNext = NULL;
+	memBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	memBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+	// Every pass builds the table from scratch, so its old contents never need to be kept
+	VkImageMemoryBarrier tableBarrier;
+	tableBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	tableBarrier.pNext = NULL;
+	tableBarrier.srcAccessMask = 0;
+	tableBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	tableBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	tableBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	tableBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	tableBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	tableBarrier.image = satImg;
+	tableBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	tableBarrier.subresourceRange.baseMipLevel = 0;
+	tableBarrier.subresourceRange.levelCount = 1;
+	tableBarrier.subresourceRange.baseArrayLayer = 0;
+	tableBarrier.subresourceRange.layerCount = 1;
+	vkCmdPipelineBarrier(cmdBuf,
+				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				0, 0, NULL, 0, NULL, 1, &tableBarrier);
+
+	vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, diffusionPipelineLayout, 0, 1, &set, 0, NULL);
+	int passes = diffusionMode == 2 ? boxIterations : 1;
+	for (int i=0; i<passes; i++) {
+		for (int stage=0; stage<3; stage++) {
+			vkCmdPipelineBarrier(cmdBuf,
+						VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+						0, 1, &memBarrier, 0, NULL, 0, NULL);
+			vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, diffusionPipelines[stage]);
+			if (stage == 0) // a workgroup per row
+				vkCmdDispatch(cmdBuf, simHeight, 1, 1);
+			else if (stage == 1) // a workgroup per column
+				vkCmdDispatch(cmdBuf, simWidth, 1, 1);
+			else
+				vkCmdDispatch(cmdBuf, (simWidth + 255) / 256, simHeight, 1);
+		}
+	}
+}
+
+// Resets the tile list and fills it with the tiles the blur of this step goes through, see tiles.comp
+void recordActiveTiles(VkCommandBuffer cmdBuf, int fromBack) {
+	VkMemoryBarrier memBarrier;
+	memBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	memBarrier.pNext = NULL;
+	// The previous blur is done reading the list
+	memBarrier.srcAccessMask = 0;
+	memBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuf,
+				VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				VK_PIPELINE_STAGE_TRANSFER_BIT,
+				0, 1, &memBarrier, 0, NULL, 0, NULL);
+	vkCmdFillBuffer(cmdBuf, tileBuf, 0, sizeof(uint32_t), 0);
+	memBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	memBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuf,
+				VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				0, 1, &memBarrier, 0, NULL, 0, NULL);
+
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, tilesPipeline);
+	vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, tilesPipelineLayout,
+				0, 1, fromBack ? &tilesBackToFront : &tilesFrontToBack, 0, NULL);
+	vkCmdDispatch(cmdBuf, (blurTilesX * blurTilesY + 255) / 256, 1, 1);
+
+	// The list is the indirect dispatch, and the blur lights tiles again
+	memBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	memBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT |
+				VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuf,
+				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				0, 1, &memBarrier, 0, NULL, 0, NULL);
+}
+
+// The image copied to the swapchains when the result is in backImg or not
+VkImage presentedImg(int inBack) {
+	if (outputImg)
+		return outputImg;
+	return inBack ? backImg : frontImg;
+}
+
+// Filtered scale of the result to the screen size, in outputImg
+void recordOutputScale(VkCommandBuffer cmdBuf, VkImage resultImg) {
+	VkImageBlit blit;
+	blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	blit.srcSubresource.mipLevel = 0;
+	blit.srcSubresource.baseArrayLayer = 0;
+	blit.srcSubresource.layerCount = 1;
+	blit.dstSubresource = blit.srcSubresource;
+	blit.srcOffsets[0].x = 0;
+	blit.srcOffsets[0].y = 0;
+	blit.srcOffsets[0].z = 0;
+	blit.srcOffsets[1].x = simWidth;
+	blit.srcOffsets[1].y = simHeight;
+	blit.srcOffsets[1].z = 1;
+	blit.dstOffsets[0] = blit.srcOffsets[0];
+	blit.dstOffsets[1].x = screenWidth;
+	blit.dstOffsets[1].y = screenHeight;
+	blit.dstOffsets[1].z = 1;
+	vkCmdBlitImage(cmdBuf, resultImg, VK_IMAGE_LAYOUT_GENERAL, outputImg, VK_IMAGE_LAYOUT_GENERAL,
+			1, &blit, VK_FILTER_LINEAR);
+
+	VkMemoryBarrier memBarrier;
+	memBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	memBarrier.pNext = NULL;
+	memBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	memBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	vkCmdPipelineBarrier(cmdBuf,
+				VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+				0, 1, &memBarrier, 0, NULL, 0, NULL);
+}
+
+// Records every simulation step of a frame into cmdBuf. Each step deposits particles into the image
+// holding the latest result and blurs it into the other one, so the result alternates between
+// images with every step. fromBack says whether the first step starts with the result in backImg.
+// With computeOnlyFrames the final result is left ready to be copied to the swapchains
+void recordSimulationSteps(VkCommandBuffer cmdBuf, int fromBack, int groupsPerSide) {
+	VkCommandBufferBeginInfo commandBufferBeginInfo;
+	commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	commandBufferBeginInfo.pNext = NULL;
+	commandBufferBeginInfo.flags = 0;
+	commandBufferBeginInfo.pInheritanceInfo = NULL;
+
+	VkRenderPassBeginInfo renderpassBeginInfo;
+	renderpassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	renderpassBeginInfo.pNext = NULL;
+	renderpassBeginInfo.renderPass = renderPass;
+	renderpassBeginInfo.renderArea.offset.x = 0;
+	renderpassBeginInfo.renderArea.offset.y = 0;
+	renderpassBeginInfo.renderArea.extent.width = simWidth;
+	renderpassBeginInfo.renderArea.extent.height = simHeight;
+	renderpassBeginInfo.clearValueCount = 0;
+	renderpassBeginInfo.pClearValues = NULL;
+
+	VkImageMemoryBarrier imageMemBarrier;
+	imageMemBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	imageMemBarrier.pNext = NULL;
+	imageMemBarrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	imageMemBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	// Without computeOnlyFrames the copy happened on the transfer queue
+	imageMemBarrier.srcQueueFamilyIndex = computeOnlyFrames ? VK_QUEUE_FAMILY_IGNORED : qFamTransferIndex;
+	imageMemBarrier.dstQueueFamilyIndex = computeOnlyFrames ? VK_QUEUE_FAMILY_IGNORED : qFamGraphicsIndex;
+	imageMemBarrier.image = presentedImg(fromBack);
+	imageMemBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	imageMemBarrier.subresourceRange.baseMipLevel = 0;
+	imageMemBarrier.subresourceRange.levelCount = 1;
+	imageMemBarrier.subresourceRange.baseArrayLayer = 0;
+	imageMemBarrier.subresourceRange.layerCount = 1;
+
+	// Both images stay in the general layout between steps, so plain memory barriers are enough
+	VkMemoryBarrier memBarrier;
+	memBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	memBarrier.pNext = NULL;
+
+	vkBeginCommandBuffer(cmdBuf, &commandBufferBeginInfo);
+	// The image with the latest result was last copied to the swapchain
+	vkCmdPipelineBarrier(cmdBuf,
+				VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+				0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
+
+	VkDeviceSize offset = 0;
+	for (int i=0; i<substeps; i++) {
+		// Box blur first, so the stages go blur, fade and deposit like on the CPU. Deposits are only marked in
+		// alpha by the compute shader and become the particle color in the fade pass
+		if (diffusionMode) {
+			recordBoxBlur(cmdBuf, fromBack ? diffuseBack : diffuseFront);
+			memBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			memBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+			vkCmdPipelineBarrier(cmdBuf,
+						VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+						0, 1, &memBarrier, 0, NULL, 0, NULL);
+		}
+		vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
+		vkCmdBindDescriptorSets(cmdBuf,
+					VK_PIPELINE_BIND_POINT_COMPUTE,
+					computePipelineLayout,
+					0, 1, fromBack ? &compBackToFront : &compFrontToBack,
+					0, NULL);
+		vkCmdDispatch(cmdBuf, groupsPerSide, groupsPerSide, groupsPerSide);
+
+		// Particles deposited by the compute shader must be visible to the blur
+		memBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		memBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INPUT_ATTACHMENT_READ_BIT |
+					VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		vkCmdPipelineBarrier(cmdBuf,
+					VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+					VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+					VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+					0, 1, &memBarrier, 0, NULL, 0, NULL);
+
+		if (computeOnlyFrames || tiledBlur) {
+			if (tiledBlur)
+				recordActiveTiles(cmdBuf, fromBack);
+			vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, blurPipeline);
+			vkCmdBindDescriptorSets(cmdBuf,
+						VK_PIPELINE_BIND_POINT_COMPUTE,
+						blurPipelineLayout,
+						0, 1, fromBack ? &blurBackToFront : &blurFrontToBack,
+						0, NULL);
+			if (tiledBlur)
+				vkCmdDispatchIndirect(cmdBuf, tileBuf, 0);
+			else
+				vkCmdDispatch(cmdBuf, (simWidth + 15) / 16, (simHeight + 15) / 16, 1);
+		} else {
+			vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+			vkCmdBindDescriptorSets(cmdBuf,
+						VK_PIPELINE_BIND_POINT_GRAPHICS,
+						graphicsPipelineLayout,
+						0, 1, fromBack ? &graphicsBack : &graphicsFront,
+						0, NULL);
+			renderpassBeginInfo.framebuffer = fromBack ? frontFb : backFb;
+			vkCmdBeginRenderPass(cmdBuf, &renderpassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+			vkCmdBindVertexBuffers(cmdBuf, 0, 1, &vertexBuf, &offset);
+			vkCmdDraw(cmdBuf, 3, 1, 0, 0);
+			vkCmdEndRenderPass(cmdBuf);
+		}
+		recordMipChain(cmdBuf, fromBack ? frontImg : backImg);
+
+		// The blurred image and its mips are used by the following compute shaders, or copied to the swapchain
+		memBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+					VK_ACCESS_TRANSFER_WRITE_BIT;
+		memBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+					VK_ACCESS_TRANSFER_READ_BIT;
+		vkCmdPipelineBarrier(cmdBuf,
+					VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+					VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+					VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+					0, 1, &memBarrier, 0, NULL, 0, NULL);
+
+		fromBack = !fromBack;
+	}
+	if (outputImg)
+		recordOutputScale(cmdBuf, fromBack ? backImg : frontImg);
+
+	if (computeOnlyFrames) {
+		// Result ends up in the transfer layout like after a copy on the transfer queue
+		imageMemBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+		imageMemBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		imageMemBarrier.image = presentedImg(fromBack);
+		vkCmdPipelineBarrier(cmdBuf,
+					VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+					VK_PIPELINE_STAGE_TRANSFER_BIT,
+					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
+	}
+	vkEndCommandBuffer(cmdBuf);
+}
+
+// Copies the slice of srcImg shown by the monitor of swapchain output to its image swapchainImg, which
+// is in oldLayout before and ready to present after. srcImg must be in the transfer source layout
+void recordSwapchainCopy(VkCommandBuffer cmdBuf, VkImage srcImg, int output, VkImage swapchainImg,
+				VkImageLayout oldLayout) {
+	VkImageMemoryBarrier imageMemBarrier;
+	imageMemBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	imageMemBarrier.pNext = NULL;
+	imageMemBarrier.srcAccessMask = 0;
+	imageMemBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	imageMemBarrier.oldLayout = oldLayout;
+	imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	imageMemBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	imageMemBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	imageMemBarrier.image = swapchainImg;
+	imageMemBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	imageMemBarrier.subresourceRange.baseMipLevel = 0;
+	imageMemBarrier.subresourceRange.levelCount = 1;
+	imageMemBarrier.subresourceRange.baseArrayLayer = 0;
+	imageMemBarrier.subresourceRange.layerCount = 1;
+	vkCmdPipelineBarrier(cmdBuf,
+				VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+				0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
+
+	VkImageCopy copyRegion;
+	copyRegion.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	copyRegion.srcSubresource.mipLevel = 0;
+	copyRegion.srcSubresource.baseArrayLayer = 0;
+	copyRegion.srcSubresource.layerCount = 1;
+	copyRegion.srcOffset.x = displayXOffsets[output];
+	copyRegion.srcOffset.y = 0;
+	copyRegion.srcOffset.z = 0;
+	copyRegion.dstSubresource = copyRegion.srcSubresource;
+	copyRegion.dstOffset.x = 0;
+	copyRegion.dstOffset.y = 0;
+	copyRegion.dstOffset.z = 0;
+	copyRegion.extent.width = displayExtents[output].width;
+	copyRegion.extent.height = displayExtents[output].height;
+	copyRegion.extent.depth = 1;
+	vkCmdCopyImage(cmdBuf, srcImg, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			swapchainImg, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+
+	imageMemBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	imageMemBarrier.dstAccessMask = 0;
+	imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	vkCmdPipelineBarrier(cmdBuf,
+				VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+				0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
+}
+
+// Workers and buffers of the CPU simulation, at xSize by ySize
+void setupCpuSimulation() {
+	startWorkers(cpuThreads);
+	printf("Simulating on %d threads\n", workerCount);
+	particles = allocHostBuffer(simParticleCount * sizeof(particle), "particles");
+	// A row for the halo above and below, tempBufs point at pixel (0, 0)
+	trailStride = TRAIL_MARGIN + (xSize + 1 + TRAIL_MARGIN - 1) / TRAIL_MARGIN * TRAIL_MARGIN;
+	tempBuf1 = (uint8_t*) allocHostBuffer((ySize + 2) * trailStride, "trail buffer") + trailStride + TRAIL_MARGIN;
+	tempBuf2 = (uint8_t*) allocHostBuffer((ySize + 2) * trailStride, "trail buffer") + trailStride + TRAIL_MARGIN;
+	buildPalette();
+	selectBlurKernel();
+	// Both trails start black
+	setTileGrid();
+	tiles1 = calloc(tilesX * tilesY, 1);
+	tiles2 = calloc(tilesX * tilesY, 1);
+	runOnWorkers(firstTouch, NULL);
+	if (sensorLevel > 0) {
+		sensorXSize = ((xSize - 1) >> sensorLevel) + 1;
+		sensorYSize = ((ySize - 1) >> sensorLevel) + 1;
+		sensorMap = (float*) calloc(sensorXSize * sensorYSize, sizeof(float));
+	}
+	if (diffusionMode)
+		satTable = (uint32_t*) malloc(xSize * ySize * sizeof(uint32_t));
+	if (diffusionBlock > MAX_DIFFUSION_BLOCK) {
+		fprintf(stderr, "diffusionBlock can be at most %d\n", MAX_DIFFUSION_BLOCK);
+		exit(1);
+	}
+	if (simDiffusionBlock > 1) {
+		blockDeposits = (uint32_t*) malloc(simDiffusionBlock * simParticleCount * sizeof(uint32_t));
+		depositStarts = (uint32_t*) malloc(simDiffusionBlock * (tilesX * tilesY + 1) * sizeof(uint32_t));
+	}
+	atexit(cleanUpOtherBuffers);
 }
 
-void genVkParticle(vkParticle *p) {
-	p->posX = rand() % (screenWidth/2) + screenWidth/4;
-	p->posY = rand() % (screenHeight/2) + screenHeight/4;
-	p->angle = (float) rand() / RAND_MAX * 2 * M_PI;
+// Intensity 255 is a fresh deposit in particleColor, and lower ones the color it fades to per channel in the
+// steps the trail takes to fade to them. Trails still change hue as they fade like the separate channels of
+// the GPU trail, and take about as many steps to fade out
+void buildPalette() {
+	const unsigned int fades[3] = {blueFade, greenFade, redFade};
+	unsigned int steps = 1; // until every channel of particleColor is black
+	int fadesOut = 1;
+	for (int c=0; c<3; c++) {
+		unsigned int channel = particleColor >> 8*c & 0xFF;
+		if (fades[c])
+			steps = max(steps, (channel + fades[c] - 1) / fades[c]);
+		else if (channel)
+			fadesOut = 0;
+	}
+	intensityFade = fadesOut ? max(1u, (255 + steps/2) / steps) : 0;
+
+	for (int v=0; v<256; v++) {
+		unsigned int age = ((255 - v) * steps + 127) / 255;
+		uint32_t color = 0;
+		for (int c=0; c<3; c++) {
+			int channel = particleColor >> 8*c & 0xFF;
+			// Trails that never fade out only get dimmer from the blur
+			channel = fadesOut ? max(0, channel - (int) (age * fades[c])) : channel * v / 255;
+			color |= (uint32_t) channel << 8*c;
+		}
+		palette[v] = color;
+		// https://en.wikipedia.org/wiki/Luma_(video)
+		paletteLuma[v] = (color & 0xFF) * 0.0722 + (color >> 8 & 0xFF) * 0.7152 + (color >> 16 & 0xFF) * 0.2126;
+	}
+}
+
+// Whether the frame loop should save a checkpoint now: when quitting or every checkpointSeconds
+int checkpointDue(int quitting) {
+	static unsigned long long lastCheckpoint;
+	unsigned long long now = getMicros();
+	if (!lastCheckpoint)
+		lastCheckpoint = now;
+	if (!checkpointPath || (!quitting && now - lastCheckpoint < checkpointSeconds * 1000000ull))
+		return 0;
+	lastCheckpoint = now;
+	return 1;
+}
+
+// Only tempBuf1 is saved, the next step's blur overwrites all of tempBuf2 before reading any of it.
+// Periodic checkpoints are written in the background from a snapshot, the one when quitting right here
+void saveCpuCheckpoint(int quitting) {
+	checkpointHeader header = {.backend = CHECKPOINT_CPU, .width = xSize, .height = ySize, .pixelSize = 1,
+				.particleCount = simParticleCount, .particleSize = sizeof(particle)};
+	if (quitting)
+		finishCheckpoint();
+	uint8_t *trail = quitting ? malloc(xSize * ySize) : checkpointSnapshot(&header); // without the stride
+	if (!trail)
+		return;
+	for (unsigned int y=0; y<ySize; y++)
+		memcpy(trail + y*xSize, tempBuf1 + pixel(0, y), xSize);
+	if (!quitting) {
+		memcpy(checkpointParticles(&header, trail), particles, simParticleCount * sizeof(particle));
+		saveCheckpointInBackground(checkpointPath, &header, trail);
+		return;
+	}
+	if (!saveCheckpoint(checkpointPath, &header, trail, particles))
+		printf("Saved checkpoint %s\n", checkpointPath);
+	free(trail);
+}
+
+// After setupCpuSimulation(). Returns 0 when there's no checkpoint to resume from
+int restoreCpuCheckpoint() {
+	checkpointHeader expected = {.backend = CHECKPOINT_CPU, .width = xSize, .height = ySize, .pixelSize = 1,
+				.particleCount = simParticleCount, .particleSize = sizeof(particle)};
+	size_t mappedSize;
+	char *mapping = checkpointPath ? loadCheckpoint(checkpointPath, &expected, &mappedSize) : NULL;
+	if (!mapping)
+		return 0;
+	const checkpointHeader *header = (checkpointHeader*) mapping;
+	// The pages were already first touched by their workers, the copy keeps them where they are
+	for (unsigned int y=0; y<ySize; y++)
+		memcpy(tempBuf1 + pixel(0, y), mapping + header->trailOffset + y*xSize, xSize);
+	memcpy(particles, mapping + header->particlesOffset, simParticleCount * sizeof(particle));
+	munmap(mapping, mappedSize);
+	markAllTiles(); // the next fade finds out which tiles are black
+	printf("Resumed from checkpoint %s\n", checkpointPath);
+	return 1;
+}
+
+// Copies the particles and img, the latest result and in layout unless it's VK_NULL_HANDLE, to the staging
+// buffer. Only called between frames, when the graphics queue owns both and nothing else uses the GPU
+void readBackState(VkCommandBuffer cmdBuf, VkImage img, VkImageLayout layout) {
+	VkCommandBufferBeginInfo commandBufferBeginInfo;
+	commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	commandBufferBeginInfo.pNext = NULL;
+	commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	commandBufferBeginInfo.pInheritanceInfo = NULL;
+	VkMemoryBarrier memBarrier;
+	memBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	memBarrier.pNext = NULL;
+	memBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+				VK_ACCESS_TRANSFER_WRITE_BIT;
+	memBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	VkBufferImageCopy copyRegion;
+	copyRegion.bufferOffset = 0;
+	copyRegion.bufferRowLength = 0; // tightly packed
+	copyRegion.bufferImageHeight = 0;
+	copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	copyRegion.imageSubresource.mipLevel = 0;
+	copyRegion.imageSubresource.baseArrayLayer = 0;
+	copyRegion.imageSubresource.layerCount = 1;
+	copyRegion.imageOffset.x = 0;
+	copyRegion.imageOffset.y = 0;
+	copyRegion.imageOffset.z = 0;
+	copyRegion.imageExtent.width = simWidth;
+	copyRegion.imageExtent.height = simHeight;
+	copyRegion.imageExtent.depth = 1;
+
+	vkResetCommandBuffer(cmdBuf, 0);
+	vkBeginCommandBuffer(cmdBuf, &commandBufferBeginInfo);
+	vkCmdPipelineBarrier(cmdBuf,
+				VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+				0, 1, &memBarrier, 0, NULL, 0, NULL);
+	if (img)
+		vkCmdCopyImageToBuffer(cmdBuf, img, layout, stagingBuf, 1, &copyRegion);
+	VkBufferCopy particlesRegion;
+	particlesRegion.srcOffset = 0;
+	particlesRegion.dstOffset = stagedParticlesOffset;
+	particlesRegion.size = simParticleCount * sizeof(vkParticle);
+	vkCmdCopyBuffer(cmdBuf, particleBuf, stagingBuf, 1, &particlesRegion);
+	// They're read by the CPU next
+	memBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	memBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(cmdBuf,
+				VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+				0, 1, &memBarrier, 0, NULL, 0, NULL);
+	vkEndCommandBuffer(cmdBuf);
+
+	VkPipelineStageFlags stageFlags = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+	VkSubmitInfo submitInfo;
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.pNext = NULL;
+	submitInfo.waitSemaphoreCount = 0;
+	submitInfo.pWaitSemaphores = NULL;
+	submitInfo.pWaitDstStageMask = &stageFlags;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &cmdBuf;
+	submitInfo.signalSemaphoreCount = 0;
+	submitInfo.pSignalSemaphores = NULL;
+	vkQueueSubmit(graphicsQueue, 1, &submitInfo, commandFence2);
+	vkWaitForFences(dev, 1, &commandFence2, VK_TRUE, ~0ull);
+	vkResetFences(dev, 1, &commandFence2);
+}
+
+// Saves img, the latest result in layout, and the particles, see readBackState(). Like saveCpuCheckpoint(),
+// only the one when quitting is written right here
+void saveVkCheckpoint(VkCommandBuffer cmdBuf, VkImage img, VkImageLayout layout, int quitting) {
+	checkpointHeader header = {.backend = CHECKPOINT_VULKAN, .width = simWidth, .height = simHeight,
+				.pixelSize = sizeof(uint32_t), .particleCount = simParticleCount, .particleSize = sizeof(vkParticle)};
+	if (quitting) {
+		finishCheckpoint();
+		readBackState(cmdBuf, img, layout);
+		if (!saveCheckpoint(checkpointPath, &header, mappedStaging, stagedParticles))
+			printf("Saved checkpoint %s\n", checkpointPath);
+		return;
+	}
+	void *snapshot = checkpointSnapshot(&header);
+	if (!snapshot)
+		return;
+	readBackState(cmdBuf, img, layout);
+	memcpy(snapshot, mappedStaging, simWidth * simHeight * sizeof(uint32_t));
+	memcpy(checkpointParticles(&header, snapshot), stagedParticles, simParticleCount * sizeof(vkParticle));
+	saveCheckpointInBackground(checkpointPath, &header, snapshot);
+}
+
+// The trail and the particles wait in the staging buffer for the setup commands to copy them to
+// backImg and the particle buffer. Returns 0 when there's no checkpoint to resume from
+int restoreVkCheckpoint() {
+	checkpointHeader expected = {.backend = CHECKPOINT_VULKAN, .width = simWidth, .height = simHeight,
+				.pixelSize = sizeof(uint32_t), .particleCount = simParticleCount, .particleSize = sizeof(vkParticle)};
+	size_t mappedSize;
+	char *mapping = checkpointPath ? loadCheckpoint(checkpointPath, &expected, &mappedSize) : NULL;
+	if (!mapping)
+		return 0;
+	const checkpointHeader *header = (checkpointHeader*) mapping;
+	memcpy(mappedStaging, mapping + header->trailOffset, simWidth * simHeight * sizeof(uint32_t));
+	memcpy(stagedParticles, mapping + header->particlesOffset, simParticleCount * sizeof(vkParticle));
+	munmap(mapping, mappedSize);
+	printf("Resumed from checkpoint %s\n", checkpointPath);
+	return 1;
+}
+
+// Converts between the packed GPU particles and CPU ones, see vkParticle in vulkanSetup.h
+void unpackVkParticle(const vkParticle *packed, particle *p) {
+	p->posX = (packed->x >> 8) / 256.0;
+	p->posY = (packed->y >> 8) / 256.0;
+	p->angle = ((packed->x & 0xFF) << 8 | (packed->y & 0xFF)) * (2 * M_PI / 65536);
 	p->dirX = particleSpeed * cos(p->angle);
 	p->dirY = particleSpeed * sin(p->angle);
 }
 
+void packVkParticle(const particle *p, vkParticle *packed) {
+	double turns = p->angle / (2 * M_PI);
+	uint32_t heading = (uint32_t) ((turns - floor(turns)) * 65536) & 0xFFFF;
+	packed->x = (uint32_t) lround(p->posX * 256) << 8 | heading >> 8;
+	packed->y = (uint32_t) lround(p->posY * 256) << 8 | (heading & 0xFF);
+}
+
+typedef struct {
+	char magic[8];
+	uint32_t version, width, height, particleCount, steps, seed;
+} snapshotHeader;
+#define SNAPSHOT_VERSION 4 // 2: particles start from init.comp, 3: packed GPU particles, 4: CPU intensity trail
+
+// How far apart two results are: mean and largest difference of the trail channels, and the fraction
+// of particles more than a pixel apart. Trails are BGRX on both backends
+void diffResults(const uint32_t *trailA, const uint32_t *trailB, const vkParticle *particlesA,
+			const vkParticle *particlesB, double *meanDiff, int *maxDiff, double *diverged) {
+	unsigned long long sum = 0;
+	*maxDiff = 0;
+	for (unsigned int i=0; i<xSize*ySize; i++) {
+		const unsigned char *a = (const unsigned char*) (trailA + i), *b = (const unsigned char*) (trailB + i);
+		for (int j=0; j<3; j++) {
+			int diff = abs(a[j] - b[j]);
+			sum += diff;
+			*maxDiff = max(*maxDiff, diff);
+		}
+	}
+	*meanDiff = (double) sum / (xSize * ySize * 3);
+
+	int far = 0;
+	for (int i=0; i<simParticleCount; i++) {
+		particle a, b;
+		unpackVkParticle(particlesA + i, &a);
+		unpackVkParticle(particlesB + i, &b);
+		double dx = a.posX - b.posX, dy = a.posY - b.posY;
+		far += dx*dx + dy*dy > 1.0;
+	}
+	*diverged = (double) far / simParticleCount;
+}
+
+int withinTolerance(const char *what, const uint32_t *trailA, const uint32_t *trailB,
+			const vkParticle *particlesA, const vkParticle *particlesB) {
+	double meanDiff, diverged;
+	int maxDiff;
+	diffResults(trailA, trailB, particlesA, particlesB, &meanDiff, &maxDiff, &diverged);
+	int pass = meanDiff <= trailTolerance && diverged <= particleTolerance;
+	printf("%s: trail mean difference %.3f, largest %d, %.2f%% of particles diverged: %s\n",
+			what, meanDiff, maxDiff, diverged * 100, pass ? "ok" : "FAILED");
+	return pass;
+}
+
+// Runs frames of substeps steps on both backends from the same particles in stagedParticles and compares
+// the CPU against the Vulkan results. With a snapshot file they're also compared against the results stored
+// in it, exactly for the CPU which only has integer kernels, or it's created if it doesn't exist yet.
+// Returns the exit status, 0 if everything is within tolerance
+int compareBackends(VkCommandBuffer stepBufs[2], VkCommandBuffer transferBuf, VkCommandBuffer readBackBuf, int frames,
+			const char *snapshotPath) {
+	xSize = compareWidth;
+	ySize = compareHeight;
+	setupCpuSimulation();
+	for (int i=0; i<simParticleCount; i++)
+		unpackVkParticle(stagedParticles + i, particles + i);
+	for (int i=0; i<workerCount * MOVE_PARTS_PER_WORKER; i++)
+		rngStates[i].state = rand();
+
+	for (int i=0; i<frames; i++)
+		draw();
+	vkParticle *cpuParticles = malloc(simParticleCount * sizeof(vkParticle));
+	for (int i=0; i<simParticleCount; i++)
+		packVkParticle(particles + i, cpuParticles + i);
+
+	// Same submissions as a displayed frame, but the last result is copied to the staging buffer
+	VkCommandBufferBeginInfo commandBufferBeginInfo;
+	commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	commandBufferBeginInfo.pNext = NULL;
+	commandBufferBeginInfo.flags = 0;
+	commandBufferBeginInfo.pInheritanceInfo = NULL;
+	VkImageMemoryBarrier imageMemBarrier;
+	imageMemBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	imageMemBarrier.pNext = NULL;
+	imageMemBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+					VK_ACCESS_TRANSFER_WRITE_BIT;
+	imageMemBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	// Compute only steps already leave their result ready to copy
+	imageMemBarrier.oldLayout = computeOnlyFrames ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+	imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	imageMemBarrier.srcQueueFamilyIndex = computeOnlyFrames ? VK_QUEUE_FAMILY_IGNORED : qFamGraphicsIndex;
+	imageMemBarrier.dstQueueFamilyIndex = computeOnlyFrames ? VK_QUEUE_FAMILY_IGNORED : qFamTransferIndex;
+	imageMemBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	imageMemBarrier.subresourceRange.baseMipLevel = 0;
+	imageMemBarrier.subresourceRange.levelCount = 1;
+	imageMemBarrier.subresourceRange.baseArrayLayer = 0;
+	imageMemBarrier.subresourceRange.layerCount = 1;
+	VkBufferImageCopy copyRegion;
+	copyRegion.bufferOffset = 0;
+	copyRegion.bufferRowLength = 0; // tightly packed
+	copyRegion.bufferImageHeight = 0;
+	copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	copyRegion.imageSubresource.mipLevel = 0;
+	copyRegion.imageSubresource.baseArrayLayer = 0;
+	copyRegion.imageSubresource.layerCount = 1;
+	copyRegion.imageOffset.x = 0;
+	copyRegion.imageOffset.y = 0;
+	copyRegion.imageOffset.z = 0;
+	copyRegion.imageExtent.width = simWidth;
+	copyRegion.imageExtent.height = simHeight;
+	copyRegion.imageExtent.depth = 1;
+
+	VkPipelineStageFlags stageFlags = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+	VkSubmitInfo submitInfo;
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.pNext = NULL;
+	submitInfo.waitSemaphoreCount = 0;
+	submitInfo.pWaitSemaphores = NULL;
+	submitInfo.pWaitDstStageMask = &stageFlags;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.signalSemaphoreCount = 0;
+	submitInfo.pSignalSemaphores = NULL;
+
+	// Setup left backImg as if it had just been copied to the swapchain
+	int resultInBack = 1;
+	for (int i=0; i<frames; i++) {
+		submitInfo.pCommandBuffers = stepBufs + resultInBack;
+		vkQueueSubmit(graphicsQueue, 1, &submitInfo, commandFence1);
+		vkWaitForFences(dev, 1, &commandFence1, VK_TRUE, ~0ull);
+		vkResetFences(dev, 1, &commandFence1);
+		if (substeps % 2)
+			resultInBack = !resultInBack;
+
+		vkResetCommandBuffer(transferBuf, 0);
+		vkBeginCommandBuffer(transferBuf, &commandBufferBeginInfo);
+		imageMemBarrier.image = presentedImg(resultInBack);
+		vkCmdPipelineBarrier(transferBuf,
+					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
+		if (i == frames - 1) {
+			vkCmdCopyImageToBuffer(transferBuf, presentedImg(resultInBack), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+						stagingBuf, 1, &copyRegion);
+		}
+		vkEndCommandBuffer(transferBuf);
+		submitInfo.pCommandBuffers = &transferBuf;
+		vkQueueSubmit(transferQueue, 1, &submitInfo, commandFence1);
+		vkWaitForFences(dev, 1, &commandFence1, VK_TRUE, ~0ull);
+		vkResetFences(dev, 1, &commandFence1);
+	}
+	readBackState(readBackBuf, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_UNDEFINED);
+
+	// The CPU trail in the colors it's shown in
+	uint32_t *cpuTrail = malloc(xSize * ySize * sizeof(uint32_t));
+	for (unsigned int y=0; y<ySize; y++) {
+		for (unsigned int x=0; x<xSize; x++)
+			cpuTrail[y*xSize + x] = palette[tempBuf1[pixel(x, y)]];
+	}
+
+	printf("Compared %d steps of %d particles at %ux%u\n", frames * substeps, simParticleCount, xSize, ySize);
+	int pass = withinTolerance("CPU against Vulkan", cpuTrail, mappedStaging, cpuParticles, stagedParticles);
+	if (!snapshotPath) {
+		free(cpuTrail);
+		free(cpuParticles);
+		return !pass;
+	}
+
+	snapshotHeader header = {"SLIMESNP", SNAPSHOT_VERSION, xSize, ySize, simParticleCount, frames * substeps, compareSeed};
+	size_t trailSize = xSize * ySize * sizeof(uint32_t), particlesSize = simParticleCount * sizeof(vkParticle);
+	FILE *snapshot = fopen(snapshotPath, "rb");
+	if (!snapshot) {
+		// Store the results as the golden ones to compare later runs against
+		snapshot = fopen(snapshotPath, "wb");
+		if (!snapshot) {
+			fprintf(stderr, "Couldn't create snapshot %s\n", snapshotPath);
+			abort();
+		}
+		fwrite(&header, sizeof(header), 1, snapshot);
+		fwrite(cpuTrail, trailSize, 1, snapshot);
+		fwrite(cpuParticles, particlesSize, 1, snapshot);
+		fwrite(mappedStaging, trailSize, 1, snapshot);
+		fwrite(stagedParticles, particlesSize, 1, snapshot);
+		fclose(snapshot);
+		printf("Wrote snapshot %s\n", snapshotPath);
+		free(cpuTrail);
+		free(cpuParticles);
+		return !pass;
+	}
+
+	snapshotHeader golden;
+	uint32_t *goldenTrail = malloc(trailSize * 2);
+	vkParticle *goldenParticles = malloc(particlesSize * 2);
+	if (fread(&golden, sizeof(golden), 1, snapshot) != 1 || memcmp(&golden, &header, sizeof(header))) {
+		fprintf(stderr, "Snapshot %s is from a different version or configuration\n", snapshotPath);
+		pass = 0;
+	} else if (fread(goldenTrail, trailSize, 1, snapshot) != 1 || fread(goldenParticles, particlesSize, 1, snapshot) != 1 ||
+			fread(goldenTrail + xSize*ySize, trailSize, 1, snapshot) != 1 ||
+			fread(goldenParticles + simParticleCount, particlesSize, 1, snapshot) != 1) {
+		fprintf(stderr, "Snapshot %s is truncated\n", snapshotPath);
+		pass = 0;
+	} else {
+		int cpuExact = !memcmp(goldenTrail, cpuTrail, trailSize) && !memcmp(goldenParticles, cpuParticles, particlesSize);
+		printf("CPU against snapshot: %s\n", cpuExact ? "identical" : "DIFFERENT");
+		pass &= cpuExact;
+		pass &= withinTolerance("Vulkan against snapshot", goldenTrail + xSize*ySize, mappedStaging,
+					goldenParticles + simParticleCount, stagedParticles);
+	}
+	fclose(snapshot);
+	free(goldenTrail);
+	free(goldenParticles);
+	free(cpuTrail);
+	free(cpuParticles);
+	return !pass;
+}
+
+int compareDoubles(const void *a, const void *b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+// Runs kernel benchWarmups times, then times benchRepetitions runs of it and prints their statistics.
+// Throughput is in GB/s of bytes per run, or in millions of items per run per second when bytes is 0
+void benchKernel(const char *name, void (*kernel)(), double bytes, double items) {
+	double times[benchRepetitions];
+	for (int i=0; i<benchWarmups; i++)
+		kernel();
+	for (int i=0; i<benchRepetitions; i++) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+		kernel();
+		clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+		times[i] = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+	}
+
+	qsort(times, benchRepetitions, sizeof(double), compareDoubles);
+	double mean = 0, variance = 0;
+	for (int i=0; i<benchRepetitions; i++)
+		mean += times[i] / benchRepetitions;
+	for (int i=0; i<benchRepetitions; i++)
+		variance += (times[i] - mean) * (times[i] - mean) / benchRepetitions;
+	double median = times[benchRepetitions / 2];
+	printf("%-14s %4ux%-4u %8d %10.1f %10.1f %10.1f %8.1f ", name, xSize, ySize, simParticleCount,
+			times[0], median, mean, sqrt(variance));
+	if (bytes > 0)
+		printf("%8.2f GB/s\n", bytes / (median * 1e3));
+	else
+		printf("%8.2f M/s\n", items / median);
+}
+
+// The trails stay random while fading, but without this the fade skips the tiles it thinks went black
+void benchFade() {
+	memset(tiles1, 1, tilesX * tilesY);
+	fade();
+}
+
+// MAX_DIFFUSION_BLOCK steps of blur and fade at once without deposits. Its bytes are those of as many separate
+// blur and fade steps, so the throughputs compare
+void benchDiffuseBlock() {
+	markAllTiles();
+	diffuseBlock(MAX_DIFFUSION_BLOCK);
+}
+
+// Hardware counters of whole frames of draw() at every size, per stage. Counts are per pixel, per particle for
+// moving them, and add up over the substeps. Stages a counter isn't available for or that didn't run show -
+void profileStages(const unsigned int sizes[][2], int sizeCount, double density) {
+	const char *stageNames[] = {"diffuse", "fade", "move", "copy"};
+	printf("\nHardware counters of %d frames after %d warmups, per pixel or particle\n", benchRepetitions, benchWarmups);
+	printf("%-8s %9s %8s %6s %10s %10s %13s\n", "stage", "size", "particles", "IPC", "LLC misses", "dTLB misses",
+			"branch misses");
+	for (int i=0; i<sizeCount; i++) {
+		xSize = sizes[i][0];
+		ySize = sizes[i][1];
+		outputXSizes[0] = screenXSize = xSize;
+		outputYSizes[0] = screenYSize = ySize;
+		double pixels = xSize * ySize;
+		setTileGrid();
+		markAllTiles();
+		simParticleCount = pixels * density;
+		for (int j=0; j<simParticleCount; j++)
+			genParticle(particles + j);
+		for (int j=0; j<benchWarmups; j++)
+			draw();
+		memset(stageCounts, 0, sizeof(stageCounts));
+		profiling = 1;
+		for (int j=0; j<benchRepetitions; j++)
+			draw();
+		profiling = 0;
+
+		for (int stage=STAGE_DIFFUSE; stage<=STAGE_COPY; stage++) {
+			const uint64_t *counts = stageCounts[stage];
+			int ran = !perfCounterAvailable[PERF_CYCLES] || counts[PERF_CYCLES];
+			double items = (stage == STAGE_MOVE ? simParticleCount : pixels) * benchRepetitions;
+			char size[16];
+			snprintf(size, sizeof(size), "%ux%u", xSize, ySize);
+			printf("%-8s %9s %8d", stageNames[stage], size, simParticleCount);
+			if (perfCounterAvailable[PERF_CYCLES] && perfCounterAvailable[PERF_INSTRUCTIONS] && ran)
+				printf(" %6.2f", (double) counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES]);
+			else
+				printf(" %6s", "-");
+			const int perItem[] = {PERF_LLC_MISSES, PERF_DTLB_MISSES, PERF_BRANCH_MISSES};
+			const int widths[] = {10, 10, 13};
+			for (int j=0; j<3; j++) {
+				if (perfCounterAvailable[perItem[j]] && ran)
+					printf(" %*.4f", widths[j], counts[perItem[j]] / items);
+				else
+					printf(" %*s", widths[j], "-");
+			}
+			printf("\n");
+		}
+	}
+}
+
+// Every CPU kernel over synthetic trails at a few resolutions and particle densities, on the pinned workers.
+// Buffers are allocated once for the largest case, smaller ones use the start of them. With profile, then
+// profileStages() as long as there are hardware counters
+void benchKernels(int profile) {
+	const unsigned int sizes[][2] = {{1280, 720}, {1920, 1080}, {3840, 2160}};
+	const double densities[] = {0.02, 0.1}; // particles per pixel
+	const int sizeCount = sizeof(sizes) / sizeof(sizes[0]), densityCount = sizeof(densities) / sizeof(densities[0]);
+
+	xSize = sizes[sizeCount-1][0];
+	ySize = sizes[sizeCount-1][1];
+	simParticleCount = xSize * ySize * densities[densityCount-1];
+	setupCpuSimulation();
+	// The final copy goes to a single screen the size of the simulation
+	uint32_t *screen = allocHostBuffer(xSize * ySize * sizeof(uint32_t), "bench screen");
+	outputCount = 1;
+	backBufs[0] = screen;
+	outputXOffsets[0] = 0;
+
+	srand(1);
+	for (unsigned int y=0; y<ySize; y++) {
+		for (unsigned int x=0; x<xSize; x++) {
+			tempBuf1[pixel(x, y)] = rand() & 0xFF;
+			tempBuf2[pixel(x, y)] = rand() & 0xFF;
+		}
+	}
+	for (int i=0; i<workerCount * MOVE_PARTS_PER_WORKER; i++)
+		rngStates[i].state = rand();
+	// Blocks without any deposits, for the largest tile grid and particle count
+	free(blockDeposits);
+	free(depositStarts);
+	blockDeposits = malloc(MAX_DIFFUSION_BLOCK * simParticleCount * sizeof(uint32_t));
+	depositStarts = calloc(MAX_DIFFUSION_BLOCK * (tilesX * tilesY + 1), sizeof(uint32_t));
+
+	printf("%d threads, median of %d runs after %d warmups, times in microseconds\n",
+			workerCount, benchRepetitions, benchWarmups);
+	printf("%-14s %9s %8s %10s %10s %10s %8s %13s\n",
+			"kernel", "size", "particles", "min", "median", "mean", "stddev", "throughput");
+	for (int i=0; i<sizeCount; i++) {
+		xSize = sizes[i][0];
+		ySize = sizes[i][1];
+		outputXSizes[0] = screenXSize = xSize;
+		outputYSizes[0] = screenYSize = ySize;
+		double pixels = xSize * ySize;
+		// Every intensity is read from one buffer and written to another, or read and written in place.
+		// The copy writes a whole XRGB pixel to the screen for each
+		setTileGrid();
+		markAllTiles();
+		// Every implementation the kernel fits, the selected one is the first
+		for (int j=0; j<blurKernelClassCount; j++) {
+			if (!blurKernelClasses[j].fits())
+				continue;
+			char name[32];
+			snprintf(name, sizeof(name), "blur %s", blurKernelClasses[j].name);
+			blurCenter = classBlurCenter(blurKernelClasses + j);
+			benchKernel(name, blur, pixels * 2, 0);
+		}
+		selectBlurKernel();
+		// Only the middle ninth of the trail lit, as early on when the particles haven't spread out yet
+		memset(tiles2, 0, tilesX * tilesY);
+		for (unsigned int ty=tilesY/3; ty<tilesY*2/3; ty++)
+			memset(tiles2 + ty*tilesX + tilesX/3, 1, tilesX*2/3 - tilesX/3);
+		benchKernel("blur sparse", blur, pixels * 2 / 9, 0);
+		markAllTiles();
+		if (satTable)
+			benchKernel("boxBlur", boxBlur, pixels * 2, 0);
+		benchKernel("fade", benchFade, pixels * 2, 0);
+		benchKernel("diffuseBlock", benchDiffuseBlock, pixels * 4 * MAX_DIFFUSION_BLOCK, 0);
+		benchKernel("copyToScreen", copyToScreen, pixels * 5, 0);
+		for (int j=0; j<densityCount; j++) {
+			simParticleCount = pixels * densities[j];
+			for (int k=0; k<simParticleCount; k++)
+				genParticle(particles + k);
+			benchKernel("moveParticles", moveParticles, 0, simParticleCount);
+		}
+	}
+
+	if (!profile)
+		return;
+	if (!openPerfCounters()) {
+		printf("\nNo hardware counters here, perf_event_paranoid may be above 2 or this may be a container or VM\n");
+		return;
+	}
+	for (int i=0; i<PERF_COUNTERS; i++) {
+		if (!perfCounterAvailable[i])
+			printf("No %s counter here\n", perfCounterNames[i]);
+	}
+	profileStages(sizes, sizeCount, densities[densityCount-1]);
+	closePerfCounters();
+}
+
+// One submission per frame: waits for the swapchain images on the GPU, runs every step, copies the result
+// and signals the present. The steps have a command buffer for each starting image, and the copies one
+// for each starting image and image of every swapchain, all submitted together
+void runComputeOnlyFrames(int groupsPerSide) {
+	VkCommandBufferAllocateInfo commandBufferInfo;
+	commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	commandBufferInfo.pNext = NULL;
+	commandBufferInfo.commandPool = graphicsPool;
+	commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	commandBufferInfo.commandBufferCount = 2;
+	VkCommandBuffer stepBufs[2];
+	vkAllocateCommandBuffers(dev, &commandBufferInfo, stepBufs);
+	recordSimulationSteps(stepBufs[0], 0, groupsPerSide);
+	recordSimulationSteps(stepBufs[1], 1, groupsPerSide);
+	commandBufferInfo.commandBufferCount = 1;
+	VkCommandBuffer checkpointBuf;
+	vkAllocateCommandBuffers(dev, &commandBufferInfo, &checkpointBuf);
+
+	VkCommandBufferBeginInfo commandBufferBeginInfo;
+	commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	commandBufferBeginInfo.pNext = NULL;
+	commandBufferBeginInfo.flags = 0;
+	commandBufferBeginInfo.pInheritanceInfo = NULL;
+	VkCommandBuffer *copyBufs[MAX_OUTPUTS];
+	for (int o=0; o<swapchainCount; o++) {
+		commandBufferInfo.commandBufferCount = 2 * imgCounts[o];
+		copyBufs[o] = malloc(2 * imgCounts[o] * sizeof(VkCommandBuffer));
+		vkAllocateCommandBuffers(dev, &commandBufferInfo, copyBufs[o]);
+		for (uint32_t i=0; i<2*imgCounts[o]; i++) {
+			// Steps starting from backImg end with the result in the other image when substeps is odd
+			int resultInBack = i >= imgCounts[o] ? substeps % 2 == 0 : substeps % 2;
+			vkBeginCommandBuffer(copyBufs[o][i], &commandBufferBeginInfo);
+			recordSwapchainCopy(copyBufs[o][i], presentedImg(resultInBack), o, images[o][i % imgCounts[o]],
+						VK_IMAGE_LAYOUT_UNDEFINED); // overwritten anyway
+			vkEndCommandBuffer(copyBufs[o][i]);
+		}
+	}
+
+	VkPipelineStageFlags stageFlags[MAX_OUTPUTS];
+	for (int o=0; o<swapchainCount; o++)
+		stageFlags[o] = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	VkCommandBuffer frameBufs[1 + MAX_OUTPUTS];
+	VkSubmitInfo submitInfo;
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.pNext = NULL;
+	submitInfo.waitSemaphoreCount = swapchainCount;
+	submitInfo.pWaitSemaphores = acquireSems;
+	submitInfo.pWaitDstStageMask = stageFlags;
+	submitInfo.commandBufferCount = 1 + swapchainCount;
+	submitInfo.pCommandBuffers = frameBufs;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &commandSem;
+
+	uint32_t imgIndices[MAX_OUTPUTS];
+	VkPresentInfoKHR presentInfo;
+	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+	presentInfo.pNext = NULL;
+	presentInfo.waitSemaphoreCount = 1;
+	presentInfo.pWaitSemaphores = &commandSem;
+	presentInfo.swapchainCount = swapchainCount;
+	presentInfo.pSwapchains = swapchains;
+	presentInfo.pImageIndices = imgIndices;
+	presentInfo.pResults = NULL;
+
+	// Setup left backImg as if it had just been copied to the swapchain
+	int resultInBack = 1;
+	frameLoopRunning = 1;
+	while (true) {
+		unsigned long long start = getMicros();
+		frameBufs[0] = stepBufs[resultInBack];
+		for (int o=0; o<swapchainCount; o++) {
+			vkAcquireNextImageKHR(dev, swapchains[o], ~0ull-1, acquireSems[o], VK_NULL_HANDLE, imgIndices + o);
+			frameBufs[1 + o] = copyBufs[o][resultInBack * imgCounts[o] + imgIndices[o]];
+		}
+		vkQueueSubmit(graphicsQueue, 1, &submitInfo, commandFence1);
+		// Every monitor flips on its own vblank, but all get the same frame
+		vkQueuePresent(graphicsQueue, &presentInfo);
+
+		// The only wait of the frame, the command buffers of the next one may use the same images
+		vkWaitForFences(dev, 1, &commandFence1, VK_TRUE, ~0ull);
+		vkResetFences(dev, 1, &commandFence1);
+		frameTelemetry.frameMicros = getMicros() - start;
+		frameTelemetry.stageMicros[STAGE_STEPS] = frameTelemetry.frameMicros;
+		publishTelemetry(&frameTelemetry);
+
+		if (substeps % 2)
+			resultInBack = !resultInBack;
+		// Without an output image the steps left the result ready for the copies to the swapchains
+		int quitting = quitRequested;
+		if (checkpointDue(quitting)) {
+			saveVkCheckpoint(checkpointBuf, resultInBack ? backImg : frontImg,
+					outputImg ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, quitting);
+		}
+		if (quitting)
+			exit(0);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	struct sigaction sigact;
 	sigact.sa_handler = sigintHandler;
@@ -93,21 +1299,57 @@ int main(int argc, char *argv[]) {
 	if (sigaction(SIGINT, &sigact, NULL))
 		abort();
 
-	if (useVulkan) {
-		vkSetup(monitorIndex);
+	selectSimd();
+	readBlurKernel();
+	simParticleCount = particleCount;
+	simDiffusionBlock = diffusionBlock;
+	int compareFrames = 0;
+	if (argc >= 2 && !strcmp(argv[1], "bench")) {
+		benchKernels(argc >= 3 && !strcmp(argv[2], "perf"));
+		return 0;
+	}
+	if (argc >= 3 && !strcmp(argv[1], "compare")) {
+		compareFrames = atoi(argv[2]);
+		useVulkan = 1;
+		simParticleCount = compareParticleCount;
+		maxRandRadianChange = 0;
+		// The blocked approximation would fail the tolerances against Vulkan, only the exact steps are compared
+		simDiffusionBlock = 1;
+	} else {
+		// Frame timings are read with ./telemetryReader, printing them would slow the frames down
+		startTelemetry();
+		atexit(stopTelemetry);
+		frameTelemetry.particleCount = simParticleCount;
+		frameTelemetry.substeps = substeps;
+	}
 
-		srand(getMicros());
-		vkRandSeed = getMicros();
-		for (int i=0; i<particleCount; i++) {
-			genVkParticle(mappedParticles + i);
+	if (useVulkan && wrapEdges) {
+		fprintf(stderr, "wrapEdges only works on the CPU, set useVulkan to 0\n");
+		exit(1);
+	}
+	if (diffusionMode && wrapEdges) {
+		fprintf(stderr, "Box diffusion doesn't wrap around, set diffusionMode to 0 for wrapEdges\n");
+		exit(1);
+	}
+	if (useVulkan) {
+		if (compareFrames) {
+			// init.comp gets the seed as a specialization constant, so it's set before the setup
+			srand(compareSeed);
+			vkRandSeed = compareSeed;
+			vkSetupHeadless(compareWidth, compareHeight);
+		} else {
+			srand(getMicros());
+			vkRandSeed = getMicros();
+			vkSetup(monitorIndices, monitorCount);
 		}
+		int restored = !compareFrames && restoreVkCheckpoint();
 
-		VkCommandBuffer graphicsBackToFrontBuf, graphicsFrontToBackBuf,
-				computeBackToFrontBuf, computeFrontToBackBuf,
+		VkCommandBuffer stepsFromBackBuf, stepsFromFrontBuf,
 				transferBuf,
-				setupBuf;
+				setupBuf,
+				checkpointBuf;
 
-		// Set up graphics commands
+		// Set up commands
 		VkCommandBufferAllocateInfo commandBufferInfo;
 		commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 		commandBufferInfo.pNext = NULL;
@@ -121,17 +1363,6 @@ int main(int argc, char *argv[]) {
 		commandBufferBeginInfo.flags = 0;
 		commandBufferBeginInfo.pInheritanceInfo = NULL;
 
-		VkRenderPassBeginInfo renderpassBeginInfo;
-		renderpassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-		renderpassBeginInfo.pNext = NULL;
-		renderpassBeginInfo.renderPass = renderPass;
-		renderpassBeginInfo.renderArea.offset.x = 0;
-		renderpassBeginInfo.renderArea.offset.y = 0;
-		renderpassBeginInfo.renderArea.extent.width = screenWidth;
-		renderpassBeginInfo.renderArea.extent.height = screenHeight;
-		renderpassBeginInfo.clearValueCount = 0;
-		renderpassBeginInfo.pClearValues = NULL;
-
 		VkImageSubresourceRange subResourceRange;
 		subResourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 		subResourceRange.baseMipLevel = 0;
@@ -157,171 +1388,128 @@ int main(int argc, char *argv[]) {
 		imageMemBarrier.subresourceRange = subResourceRange;
 
 		// First create setup command buffer to be executed once
-		// When the loop starts the compute command buffer should see the images as if they
+		// When the loop starts the simulation command buffer should see the images as if they
 		// had just come from a previous finished loop
 		// Also move all swapchain images from undefined to present layout
 		vkAllocateCommandBuffers(dev, &commandBufferInfo, &setupBuf);
 		vkBeginCommandBuffer(setupBuf, &commandBufferBeginInfo);
+		// Every mip level of both images stays in the general layout, except for level 0 when copying
 		imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
 		imageMemBarrier.srcQueueFamilyIndex = 0;
-		imageMemBarrier.dstQueueFamilyIndex = qFamTransferIndex;
+		imageMemBarrier.dstQueueFamilyIndex = qFamGraphicsIndex;
+		imageMemBarrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
 		imageMemBarrier.image = frontImg;
 		vkCmdPipelineBarrier(setupBuf,
 					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
 					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
-		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-		imageMemBarrier.dstQueueFamilyIndex = qFamComputeIndex;
+		if (outputImg) {
+			imageMemBarrier.image = outputImg;
+			vkCmdPipelineBarrier(setupBuf,
+						VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+						0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
+		}
 		imageMemBarrier.image = backImg;
 		vkCmdPipelineBarrier(setupBuf,
 					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
 					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
-
-		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-		imageMemBarrier.dstQueueFamilyIndex = qFamGraphicsIndex;
-		for (uint32_t i=0; i<imgCount; i++) {
-			imageMemBarrier.image = images[i];
+		// The first step starts from backImg, so a restored trail goes there, and the restored particles to
+		// their buffer. Otherwise init.comp places the particles
+		VkMemoryBarrier memBarrier;
+		memBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		memBarrier.pNext = NULL;
+		VkBufferCopy particlesRegion;
+		particlesRegion.srcOffset = stagedParticlesOffset;
+		particlesRegion.dstOffset = 0;
+		particlesRegion.size = simParticleCount * sizeof(vkParticle);
+		if (restored) {
+			VkBufferImageCopy copyRegion;
+			copyRegion.bufferOffset = 0;
+			copyRegion.bufferRowLength = 0; // tightly packed
+			copyRegion.bufferImageHeight = 0;
+			copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			copyRegion.imageSubresource.mipLevel = 0;
+			copyRegion.imageSubresource.baseArrayLayer = 0;
+			copyRegion.imageSubresource.layerCount = 1;
+			copyRegion.imageOffset.x = 0;
+			copyRegion.imageOffset.y = 0;
+			copyRegion.imageOffset.z = 0;
+			copyRegion.imageExtent.width = simWidth;
+			copyRegion.imageExtent.height = simHeight;
+			copyRegion.imageExtent.depth = 1;
+			vkCmdCopyBufferToImage(setupBuf, stagingBuf, backImg, VK_IMAGE_LAYOUT_GENERAL, 1, &copyRegion);
+			vkCmdCopyBuffer(setupBuf, stagingBuf, particleBuf, 1, &particlesRegion);
+			memBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		} else {
+			// 2D grid of groups, a dispatch can't be more than 65535 groups wide
+			uint32_t initGroups = (simParticleCount + 255) / 256;
+			uint32_t initRows = (initGroups + 65534) / 65535;
+			vkCmdBindPipeline(setupBuf, VK_PIPELINE_BIND_POINT_COMPUTE, initPipeline);
+			vkCmdBindDescriptorSets(setupBuf, VK_PIPELINE_BIND_POINT_COMPUTE, computePipelineLayout,
+						0, 1, &compBackToFront, 0, NULL);
+			vkCmdDispatch(setupBuf, (initGroups + initRows - 1) / initRows, initRows, 1);
+			memBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		}
+		// Every tile starts out lit, the first blur finds out which are black. This also sets the y and z of the
+		// indirect dispatch of the blur to 1, the x is reset every step
+		vkCmdFillBuffer(setupBuf, tileBuf, 0, VK_WHOLE_SIZE, 1);
+		memBarrier.srcAccessMask |= VK_ACCESS_TRANSFER_WRITE_BIT;
+		memBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+					VK_ACCESS_INPUT_ATTACHMENT_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT |
+					VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+		vkCmdPipelineBarrier(setupBuf,
+					VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+					0, 1, &memBarrier, 0, NULL, 0, NULL);
+		// The CPU simulation of compare mode starts from the same particles
+		if (compareFrames) {
+			particlesRegion.srcOffset = 0;
+			particlesRegion.dstOffset = stagedParticlesOffset;
+			vkCmdCopyBuffer(setupBuf, particleBuf, stagingBuf, 1, &particlesRegion);
+			memBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			memBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
 			vkCmdPipelineBarrier(setupBuf,
-					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
+						VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+						0, 1, &memBarrier, 0, NULL, 0, NULL);
 		}
-		vkEndCommandBuffer(setupBuf);
-
-		vkAllocateCommandBuffers(dev, &commandBufferInfo, &graphicsBackToFrontBuf);
-		vkAllocateCommandBuffers(dev, &commandBufferInfo, &graphicsFrontToBackBuf);
-		vkBeginCommandBuffer(graphicsBackToFrontBuf, &commandBufferBeginInfo);
-		vkBeginCommandBuffer(graphicsFrontToBackBuf, &commandBufferBeginInfo);
-		imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemBarrier.srcQueueFamilyIndex = qFamComputeIndex;
-		imageMemBarrier.dstQueueFamilyIndex = qFamGraphicsIndex;
-		imageMemBarrier.image = frontImg;
-		vkCmdPipelineBarrier(graphicsBackToFrontBuf,
-					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
-		imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemBarrier.srcQueueFamilyIndex = qFamComputeIndex;
-		imageMemBarrier.dstQueueFamilyIndex = qFamGraphicsIndex;
-		imageMemBarrier.image = backImg;
-		vkCmdPipelineBarrier(graphicsBackToFrontBuf,
-					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
-
-		imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemBarrier.srcQueueFamilyIndex = qFamComputeIndex;
-		imageMemBarrier.dstQueueFamilyIndex = qFamGraphicsIndex;
-		imageMemBarrier.image = backImg;
-		vkCmdPipelineBarrier(graphicsFrontToBackBuf,
-					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
+		imageMemBarrier.subresourceRange.levelCount = 1;
+		imageMemBarrier.image = presentedImg(1);
 		imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemBarrier.srcQueueFamilyIndex = qFamComputeIndex;
-		imageMemBarrier.dstQueueFamilyIndex = qFamGraphicsIndex;
-		imageMemBarrier.image = frontImg;
-		vkCmdPipelineBarrier(graphicsFrontToBackBuf,
+		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		vkCmdPipelineBarrier(setupBuf,
 					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
 					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
 
+		imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 
+		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		imageMemBarrier.dstQueueFamilyIndex = qFamGraphicsIndex;
+		for (int o=0; o<swapchainCount; o++) {
+			for (uint32_t i=0; i<imgCounts[o]; i++) {
+				imageMemBarrier.image = images[o][i];
+				vkCmdPipelineBarrier(setupBuf,
+						VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+						0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
+			}
+		}
+		vkEndCommandBuffer(setupBuf);
 
-		vkCmdBindPipeline(graphicsBackToFrontBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-		vkCmdBindPipeline(graphicsFrontToBackBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-		vkCmdBindDescriptorSets(graphicsBackToFrontBuf,
-					VK_PIPELINE_BIND_POINT_GRAPHICS,
-					graphicsPipelineLayout,
-					0, 1, &graphicsBack,
-					0, NULL);
-		vkCmdBindDescriptorSets(graphicsFrontToBackBuf,
-					VK_PIPELINE_BIND_POINT_GRAPHICS,
-					graphicsPipelineLayout,
-					0, 1, &graphicsFront,
-					0, NULL);
-		renderpassBeginInfo.framebuffer = frontFb;
-		vkCmdBeginRenderPass(graphicsBackToFrontBuf, &renderpassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-		renderpassBeginInfo.framebuffer = backFb;
-		vkCmdBeginRenderPass(graphicsFrontToBackBuf, &renderpassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-		VkDeviceSize offset = 0;
-		vkCmdBindVertexBuffers(graphicsBackToFrontBuf, 0, 1, &vertexBuf, &offset);
-		vkCmdBindVertexBuffers(graphicsFrontToBackBuf, 0, 1, &vertexBuf, &offset);
-		vkCmdDraw(graphicsBackToFrontBuf, 3, 1, 0, 0);
-		vkCmdDraw(graphicsFrontToBackBuf, 3, 1, 0, 0);
-		vkCmdEndRenderPass(graphicsBackToFrontBuf);
-		vkCmdEndRenderPass(graphicsFrontToBackBuf);
-		vkEndCommandBuffer(graphicsBackToFrontBuf);
-		vkEndCommandBuffer(graphicsFrontToBackBuf);
-
-		// Set up compute commands
-		// The front image is already in general layout, and the back image moves from transfer to general
-		commandBufferInfo.commandPool = computePool;
-		vkAllocateCommandBuffers(dev, &commandBufferInfo, &computeBackToFrontBuf);
-		vkAllocateCommandBuffers(dev, &commandBufferInfo, &computeFrontToBackBuf);
-		vkBeginCommandBuffer(computeBackToFrontBuf, &commandBufferBeginInfo);
-		vkBeginCommandBuffer(computeFrontToBackBuf, &commandBufferBeginInfo);
-		vkCmdBindPipeline(computeBackToFrontBuf, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
-		vkCmdBindPipeline(computeFrontToBackBuf, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
-		vkCmdBindDescriptorSets(computeBackToFrontBuf,
-					VK_PIPELINE_BIND_POINT_COMPUTE,
-					computePipelineLayout,
-					0, 1, &compBackToFront,
-					0, NULL);
-		vkCmdBindDescriptorSets(computeFrontToBackBuf,
-					VK_PIPELINE_BIND_POINT_COMPUTE,
-					computePipelineLayout,
-					0, 1, &compFrontToBack,
-					0, NULL);
-		imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemBarrier.srcQueueFamilyIndex = qFamTransferIndex;
-		imageMemBarrier.dstQueueFamilyIndex = qFamComputeIndex;
-		imageMemBarrier.image = backImg;
-		vkCmdPipelineBarrier(computeBackToFrontBuf,
-					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
-		imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-		imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemBarrier.srcQueueFamilyIndex = qFamTransferIndex;
-		imageMemBarrier.dstQueueFamilyIndex = qFamComputeIndex;
-		imageMemBarrier.image = frontImg;
-		vkCmdPipelineBarrier(computeFrontToBackBuf,
-					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
-
-		int localGroupsNeeded = particleCount / particlesPerGroup;
+		// All the simulation steps of a frame go in a single command buffer, recorded once.
+		// The first step starts from the image that was last copied to the swapchain
+		int localGroupsNeeded = simParticleCount / particlesPerGroup;
 		int cubeSide = 1;
 		while (cubeSide*cubeSide*cubeSide < localGroupsNeeded) // I don't know if this dumb or not
 			cubeSide++;
-		vkCmdDispatch(computeFrontToBackBuf, cubeSide, cubeSide, cubeSide);
-		vkCmdDispatch(computeBackToFrontBuf, cubeSide, cubeSide, cubeSide);
-		vkEndCommandBuffer(computeBackToFrontBuf);
-		vkEndCommandBuffer(computeFrontToBackBuf);
+		vkAllocateCommandBuffers(dev, &commandBufferInfo, &stepsFromBackBuf);
+		vkAllocateCommandBuffers(dev, &commandBufferInfo, &stepsFromFrontBuf);
+		recordSimulationSteps(stepsFromBackBuf, 1, cubeSide);
+		recordSimulationSteps(stepsFromFrontBuf, 0, cubeSide);
+		vkAllocateCommandBuffers(dev, &commandBufferInfo, &checkpointBuf);
 
-		// Create transfer command buffer and copy region struct
+		// Create transfer command buffer
 		commandBufferInfo.commandPool = transferPool;
 		vkAllocateCommandBuffers(dev, &commandBufferInfo, &transferBuf);
 
-		VkImageSubresourceLayers subresource;
-		subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		subresource.mipLevel = 0;
-		subresource.baseArrayLayer = 0;
-		subresource.layerCount = 1;
-
-		VkOffset3D copyOffset;
-		copyOffset.x = 0;
-		copyOffset.y = 0;
-		copyOffset.z = 0;
-
-		VkImageCopy copyRegion;
-		copyRegion.srcSubresource = subresource;
-		copyRegion.srcOffset = copyOffset;
-		copyRegion.dstSubresource = subresource;
-		copyRegion.dstOffset = copyOffset;
-		copyRegion.extent.width = screenWidth;
-		copyRegion.extent.height = screenHeight;
-		copyRegion.extent.depth = 1;
-
 		VkSubmitInfo submitInfo;
 		VkPipelineStageFlags stageFlags = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -335,82 +1523,71 @@ int main(int argc, char *argv[]) {
 		vkQueueSubmit(graphicsQueue, 1, &submitInfo, commandFence1);
 		vkWaitForFences(dev, 1, &commandFence1, VK_TRUE, ~0ull);
 		vkResetFences(dev, 1, &commandFence1);
+		if (compareFrames) {
+			atexit(vkCleanup);
+			VkCommandBuffer stepBufs[2] = {stepsFromFrontBuf, stepsFromBackBuf};
+			exit(compareBackends(stepBufs, transferBuf, checkpointBuf, compareFrames, argc >= 4 ? argv[3] : NULL));
+		}
+		if (computeOnlyFrames)
+			runComputeOnlyFrames(cubeSide);
 		submitInfo.signalSemaphoreCount = 1;
 		submitInfo.pSignalSemaphores = &commandSem;
+		// Setup left backImg as if it had just been copied to the swapchain
+		int resultInBack = 1;
+		frameLoopRunning = 1;
 		while (true) {
-			// Swap front and back
-			swap(frontImg, backImg);
-			swap(graphicsBackToFrontBuf, graphicsFrontToBackBuf);
-			swap(computeBackToFrontBuf, computeFrontToBackBuf);
-
-			// Submit compute and graphics command buffers
+			// Submit every simulation step of this frame at once
 			submitInfo.waitSemaphoreCount = 0;
 			submitInfo.pWaitSemaphores = NULL;
-			submitInfo.pCommandBuffers = &computeFrontToBackBuf;
-			vkQueueSubmit(computeQueue, 1, &submitInfo, commandFence1);
+			submitInfo.pCommandBuffers = resultInBack ? &stepsFromBackBuf : &stepsFromFrontBuf;
+			vkQueueSubmit(graphicsQueue, 1, &submitInfo, commandFence1);
 			unsigned long long start = getMicros();
 			vkWaitForFences(dev, 1, &commandFence1, VK_TRUE, ~0ull);
 			unsigned long long end = getMicros();
-			unsigned long long elapsed = end - start;
-			printf("%llu microseconds for compute\n", elapsed);
-
-			submitInfo.waitSemaphoreCount = 1;
-			submitInfo.pWaitSemaphores = &commandSem;
-			submitInfo.pCommandBuffers = &graphicsFrontToBackBuf;
-			vkQueueSubmit(graphicsQueue, 1, &submitInfo, commandFence2);
-			start = getMicros();
-			vkWaitForFences(dev, 1, &commandFence2, VK_TRUE, ~0ull);
-			end = getMicros();
-			elapsed = end - start;
-			printf("%llu microseconds for graphics\n", elapsed);
+			frameTelemetry.stageMicros[STAGE_STEPS] = end - start;
 
 			vkResetFences(dev, 1, &commandFence1);
-			vkResetFences(dev, 1, &commandFence2);
-			// Get next swapchain image
-			uint32_t imgIndex;
-			vkAcquireNextImageKHR(dev, swapchain, ~0ull-1, VK_NULL_HANDLE, swapFence, &imgIndex);
-			vkWaitForFences(dev, 1, &swapFence, VK_TRUE, ~0ull);
-			vkResetFences(dev, 1, &swapFence);
-
-			// Transfer to swapchain image
-			// First move backImg and swapchain image to transfer layouts, then transfer, then move
-			// swapchain image back to present layout
+			// Each step leaves its result in the other image
+			if (substeps % 2)
+				resultInBack = !resultInBack;
+			// Before the transfer queue takes the result over for the copies to the swapchains
+			int quitting = quitRequested;
+			if (checkpointDue(quitting))
+				saveVkCheckpoint(checkpointBuf, resultInBack ? backImg : frontImg, VK_IMAGE_LAYOUT_GENERAL, quitting);
+			VkImage resultImg = presentedImg(resultInBack);
+
+			// Get next image of every swapchain
+			uint32_t imgIndices[MAX_OUTPUTS];
+			for (int o=0; o<swapchainCount; o++) {
+				vkAcquireNextImageKHR(dev, swapchains[o], ~0ull-1, VK_NULL_HANDLE, swapFence, imgIndices + o);
+				vkWaitForFences(dev, 1, &swapFence, VK_TRUE, ~0ull);
+				vkResetFences(dev, 1, &swapFence);
+			}
+
+			// Transfer to swapchain images
+			// First move resultImg to transfer layout, then copy its slice of every monitor, moving
+			// the swapchain images to transfer and back to present layout around the copy
 			// wait for second command buffer execution before continuing
 			vkResetCommandBuffer(transferBuf, 0);
 			vkBeginCommandBuffer(transferBuf, &commandBufferBeginInfo);
 			imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
 			imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-			imageMemBarrier.srcQueueFamilyIndex = qFamComputeIndex;
-			imageMemBarrier.dstQueueFamilyIndex = qFamTransferIndex;
-			imageMemBarrier.image = backImg;
-			vkCmdPipelineBarrier(transferBuf,
-					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
-			imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-			imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
 			imageMemBarrier.srcQueueFamilyIndex = qFamGraphicsIndex;
-			imageMemBarrier.dstQueueFamilyIndex = qFamGraphicsIndex;
-			imageMemBarrier.image = images[imgIndex];
-			vkCmdPipelineBarrier(transferBuf,
-					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
-			vkCmdCopyImage(transferBuf, backImg, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-					images[imgIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-			imageMemBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-			imageMemBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-			imageMemBarrier.srcQueueFamilyIndex = qFamGraphicsIndex;
-			imageMemBarrier.dstQueueFamilyIndex = qFamGraphicsIndex;
-			imageMemBarrier.image = images[imgIndex];
+			imageMemBarrier.dstQueueFamilyIndex = qFamTransferIndex;
+			imageMemBarrier.image = resultImg;
 			vkCmdPipelineBarrier(transferBuf,
 					VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
 					0, 0, NULL, 0, NULL, 1, &imageMemBarrier);
+			for (int o=0; o<swapchainCount; o++) {
+				recordSwapchainCopy(transferBuf, resultImg, o, images[o][imgIndices[o]],
+							VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+			}
 			vkEndCommandBuffer(transferBuf);
 
+			submitInfo.waitSemaphoreCount = 1;
+			submitInfo.pWaitSemaphores = &commandSem;
 			submitInfo.pCommandBuffers = &transferBuf;
 			vkQueueSubmit(transferQueue, 1, &submitInfo, commandFence1);
-			// moved up to measure compute time
-			//vkWaitForFences(dev, 1, &commandFence2, VK_TRUE, ~0ull);
-			//vkResetFences(dev, 1, &commandFence2);
 
 			// Present swapchain image, and wait for all command buffer executions before restarting loop
 			VkPresentInfoKHR presentInfo;
@@ -418,37 +1595,64 @@ int main(int argc, char *argv[]) {
 			presentInfo.pNext = NULL;
 			presentInfo.waitSemaphoreCount = 1;
 			presentInfo.pWaitSemaphores = &commandSem;
-			presentInfo.swapchainCount = 1;
-			presentInfo.pSwapchains = &swapchain;
-			presentInfo.pImageIndices = &imgIndex;
+			presentInfo.swapchainCount = swapchainCount;
+			presentInfo.pSwapchains = swapchains;
+			presentInfo.pImageIndices = imgIndices;
 			presentInfo.pResults = NULL;
 			vkQueuePresent(graphicsQueue, &presentInfo);
 			vkWaitForFences(dev, 1, &commandFence1, VK_TRUE, ~0ull);
 			vkResetFences(dev, 1, &commandFence1);
+			unsigned long long presented = getMicros();
+			frameTelemetry.stageMicros[STAGE_PRESENT] = presented - end;
+			frameTelemetry.frameMicros = presented - start;
+			publishTelemetry(&frameTelemetry);
+			if (quitting)
+				exit(0);
 		}
 		atexit(vkCleanup);
 	} else {
-		getDumbBuffers(monitorIndex);
+		getDumbBuffers(monitorIndices, monitorCount);
 		atexit(cleanUpDumbBuffers);
+		xSize = simulationWidth ? simulationWidth : screenXSize * simulationScale;
+		ySize = simulationHeight ? simulationHeight : screenYSize * simulationScale;
+		if (xSize != screenXSize || ySize != screenYSize) {
+			printf("Simulating at %ux%u\n", xSize, ySize);
+			scaleX0 = malloc(screenXSize * sizeof(unsigned int));
+			scaleWX = malloc(screenXSize * sizeof(unsigned int));
+			scaleY0 = malloc(screenYSize * sizeof(unsigned int));
+			scaleWY = malloc(screenYSize * sizeof(unsigned int));
+			getScaleWeights(scaleX0, scaleWX, screenXSize, xSize);
+			getScaleWeights(scaleY0, scaleWY, screenYSize, ySize);
+		}
 
-		particles = malloc(particleCount * sizeof(particle));
-		tempBuf1 = (uint32_t*) calloc(xSize * ySize, sizeof(uint32_t));
-		tempBuf2 = (uint32_t*) calloc(xSize * ySize, sizeof(uint32_t));
-		atexit(cleanUpOtherBuffers);
+		// The present thread only waits, it doesn't need to inherit the affinity of the first worker
+		startPresentThread();
+		setupCpuSimulation();
 
 		srand(getMicros());
-		for (int i=0; i<particleCount; i++) {
+		int restored = restoreCpuCheckpoint();
+		for (int i=0; i<simParticleCount && !restored; i++) {
 			genParticle(particles + i);
 		}
+		for (int i=0; i<workerCount * MOVE_PARTS_PER_WORKER; i++)
+			rngStates[i].state = rand();
 
+		// This thread only simulates, page flips happen on the present thread at their own pace
+		frameLoopRunning = 1;
 		while (1) {
 			unsigned long long start = getMicros();
-			draw(backBuf);
-			unsigned long long end = getMicros();
-			waitVBlankAndSwapBuffers();
+			draw();
+			frameTelemetry.frameMicros = getMicros() - start;
+			publishFrame();
+
+			frameTelemetry.staleVblanks = atomic_load_explicit(&staleVblanks, memory_order_relaxed);
+			publishTelemetry(&frameTelemetry);
 
-			unsigned long long elapsed = end - start;
-			printf("%llu microseconds this frame\n", elapsed);
+			int quitting = quitRequested;
+			if (checkpointDue(quitting))
+				saveCpuCheckpoint(quitting);
+			if (quitting)
+				exit(0);
 		}
 	}
 	return 0;
@@ -460,155 +1664,391 @@ unsigned long long getMicros() {
 	return tms.tv_sec*1000000llu + tms.tv_nsec/1000llu;
 }
 
+// Same layouts as init.comp does for Vulkan
 void genParticle(particle *p) {
-	p->posX = rand() % (xSize/2) + xSize/4;
-	p->posY = rand() % (ySize/2) + ySize/4;
-	p->angle = (double) rand() / RAND_MAX * 2 * M_PI;
+	double radius = min(xSize, ySize) / 4.0;
+	double angle = (double) rand() / RAND_MAX * 2 * M_PI;
+	if (spawnLayout == 1) {
+		// sqrt keeps the density uniform over the disc
+		double distance = radius * sqrt((double) rand() / RAND_MAX);
+		p->posX = xSize / 2.0 + distance * cos(angle);
+		p->posY = ySize / 2.0 + distance * sin(angle);
+		p->angle = (double) rand() / RAND_MAX * 2 * M_PI;
+	} else if (spawnLayout == 2) {
+		double distance = radius * (1 + 0.05 * rand() / RAND_MAX);
+		p->posX = xSize / 2.0 + distance * cos(angle);
+		p->posY = ySize / 2.0 + distance * sin(angle);
+		p->angle = angle + M_PI;
+	} else {
+		p->posX = rand() % (xSize/2) + xSize/4;
+		p->posY = rand() % (ySize/2) + ySize/4;
+		p->angle = angle;
+	}
 	p->dirX = particleSpeed * cos(p->angle);
 	p->dirY = particleSpeed * sin(p->angle);
 }
 
-void blur() {
-	// In edges and corners treat the out of bounds as if extended infinitely by the same value as the edge
-	unsigned char *target, *ul, *uc, *ur, *cl, *cc, *cr, *dl, *dc, *dr; // up left, up center, up right, etc
-	unsigned int temp;
-	// corners
-	target = (unsigned char*) (tempBuf1 + pixel(0, 0));
-	cc = (unsigned char*) (tempBuf2 + pixel(0, 0));
-	cr = (unsigned char*) (tempBuf2 + pixel(1, 0));
-	dc = (unsigned char*) (tempBuf2 + pixel(0, 1));
-	dr = (unsigned char*) (tempBuf2 + pixel(1, 1));
-	for (int i=0; i<3; i++) {
-		temp = cc[i]*(blurKernel[0]+blurKernel[1]+blurKernel[3]+blurKernel[4]) +
-			cr[i]*(blurKernel[2]+blurKernel[5]) + dc[i]*(blurKernel[6]+blurKernel[7]) + dr[i]*blurKernel[8];
-		target[i] = temp / blurDivide;
-	}
-	target = (unsigned char*) (tempBuf1 + pixel(xSize-1, 0));
-	cl = (unsigned char*) (tempBuf2 + pixel(xSize-2, 0));
-	cc = (unsigned char*) (tempBuf2 + pixel(xSize-1, 0));
-	dl = (unsigned char*) (tempBuf2 + pixel(xSize-2, 1));
-	dc = (unsigned char*) (tempBuf2 + pixel(xSize-1, 1));
-	for (int i=0; i<3; i++) {
-		temp = cc[i]*(blurKernel[1]+blurKernel[2]+blurKernel[4]+blurKernel[5]) +
-			cl[i]*(blurKernel[0]+blurKernel[3]) + dc[i]*(blurKernel[7]+blurKernel[8]) + dl[i]*blurKernel[6];
-		target[i] = temp / blurDivide;
-	}
-	target = (unsigned char*) (tempBuf1 + pixel(0, ySize-1));
-	uc = (unsigned char*) (tempBuf2 + pixel(0, ySize-2));
-	ur = (unsigned char*) (tempBuf2 + pixel(1, ySize-2));
-	cc = (unsigned char*) (tempBuf2 + pixel(0, ySize-1));
-	cr = (unsigned char*) (tempBuf2 + pixel(1, ySize-1));
-	for (int i=0; i<3; i++) {
-		temp = cc[i]*(blurKernel[3]+blurKernel[4]+blurKernel[6]+blurKernel[7]) +
-			uc[i]*(blurKernel[0]+blurKernel[1]) + cr[i]*(blurKernel[5]+blurKernel[8]) + ur[i]*blurKernel[2];
-		target[i] = temp / blurDivide;
-	}
-	target = (unsigned char*) (tempBuf1 + pixel(xSize-1, ySize-1));
-	ul = (unsigned char*) (tempBuf2 + pixel(xSize-2, ySize-2));
-	uc = (unsigned char*) (tempBuf2 + pixel(xSize-1, ySize-2));
-	cl = (unsigned char*) (tempBuf2 + pixel(xSize-2, ySize-1));
-	cc = (unsigned char*) (tempBuf2 + pixel(xSize-1, ySize-1));
+// Tile grid of the current xSize by ySize
+void setTileGrid() {
+	tilesX = (xSize + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (ySize + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+// For when the trails were written without keeping track of which tiles are black
+void markAllTiles() {
+	memset(tiles1, 1, tilesX * tilesY);
+	memset(tiles2, 1, tilesX * tilesY);
+}
+
+// The rows of the trails the worker owns, whole rows of tiles so no two workers write the same tile's activity
+void workerRows(int worker, unsigned int *begin, unsigned int *end) {
+	workerRange(worker, tilesY, begin, end);
+	*begin *= TILE_SIZE;
+	*end = min(*end * TILE_SIZE, ySize);
+}
+
+// Zeroes the rows of both trail buffers and the particles each worker owns, so the pages of each
+// part are placed on the NUMA node of the worker that keeps using them
+void firstTouch(int worker, void *arg) {
+	(void) arg;
+	unsigned int begin, end;
+	workerRows(worker, &begin, &end);
+	memset(tempBuf1 + pixel(0, begin) - TRAIL_MARGIN, 0, (end - begin) * trailStride);
+	memset(tempBuf2 + pixel(0, begin) - TRAIL_MARGIN, 0, (end - begin) * trailStride);
+	workerRange(worker, simParticleCount, &begin, &end);
+	memset(particles + begin, 0, (end - begin) * sizeof(particle));
+}
+
+// Whether the blur of tile (tx, ty) can come out other than black: when it or one of its neighbors is
+// active in tempBuf2, since the kernel only reaches a pixel further. Neighbors wrap around with wrapEdges
+int nearActiveTile(unsigned int tx, unsigned int ty) {
+	for (int dy=-1; dy<=1; dy++) {
+		int y = ty + dy;
+		if (y < 0 || y >= (int)tilesY) {
+			if (!wrapEdges)
+				continue;
+			y = (y + tilesY) % tilesY;
+		}
+		for (int dx=-1; dx<=1; dx++) {
+			int x = tx + dx;
+			if (x < 0 || x >= (int)tilesX) {
+				if (!wrapEdges)
+					continue;
+				x = (x + tilesX) % tilesX;
+			}
+			if (tiles2[y*tilesX + x])
+				return 1;
+		}
+	}
+	return 0;
+}
+
+// Every pixel is the full 9 taps of blurKernel
+void blurCenterGeneral(unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1) {
+	for (unsigned int y=y0; y<y1; y++) {
+		// From the pixel left of x0, which may be in the halo
+		const uint8_t *center = tempBuf2 + pixel(x0, y) - 1, *up = center - trailStride, *down = center + trailStride;
+		uint8_t *target = tempBuf1 + pixel(x0, y);
+		for (unsigned int x=0; x<x1-x0; x++) {
+			unsigned int temp = up[x]*blurKernel[0] + up[x+1]*blurKernel[1] + up[x+2]*blurKernel[2] +
+				center[x]*blurKernel[3] + center[x+1]*blurKernel[4] + center[x+2]*blurKernel[5] +
+				down[x]*blurKernel[6] + down[x+1]*blurKernel[7] + down[x+2]*blurKernel[8];
+			target[x] = temp / blurDivide;
+		}
+	}
+}
+
+// Same corners and same sides: 3 multiplications instead of 9
+void blurCenterSymmetric(unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1) {
+	unsigned int corner = blurKernel[0], side = blurKernel[1], middle = blurKernel[4];
+	for (unsigned int y=y0; y<y1; y++) {
+		const uint8_t *center = tempBuf2 + pixel(x0, y) - 1, *up = center - trailStride, *down = center + trailStride;
+		uint8_t *target = tempBuf1 + pixel(x0, y);
+		for (unsigned int x=0; x<x1-x0; x++) {
+			unsigned int temp = (up[x] + up[x+2] + down[x] + down[x+2]) * corner +
+				(up[x+1] + center[x] + center[x+2] + down[x+1]) * side + center[x+1] * middle;
+			target[x] = temp / blurDivide;
+		}
+	}
+}
+
+// A kernel that is colTaps times rowTaps times scale, as a pass over the rows and one over the columns of
+// their results. The sums come out the same as the 9 taps, so the results are identical. Inlined into every
+// caller, so the taps and divide of the ones passing constants are folded in, and compiled for its SIMD level
+static inline __attribute__((always_inline)) void separableCenter(unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1,
+			const unsigned int rowTaps[3], const unsigned int colTaps[3], unsigned int scale, unsigned int divide) {
+	unsigned int width = x1 - x0;
+	unsigned int rows[(TILE_SIZE + 2) * TILE_SIZE]; // the rows of the tile and the ones above and below it
+	// From the pixel above and left of (x0, y0), which may be in the halo
+	const uint8_t *source = tempBuf2 + pixel(x0, y0) - trailStride - 1;
+	for (unsigned int r=0; r<y1-y0+2; r++, source += trailStride) {
+		unsigned int *row = rows + r * width;
+		for (unsigned int x=0; x<width; x++)
+			row[x] = source[x]*rowTaps[0] + source[x+1]*rowTaps[1] + source[x+2]*rowTaps[2];
+	}
+	for (unsigned int y=y0; y<y1; y++) {
+		const unsigned int *up = rows + (y - y0) * width, *center = up + width, *down = center + width;
+		uint8_t *target = tempBuf1 + pixel(x0, y);
+		for (unsigned int x=0; x<width; x++)
+			target[x] = (up[x]*colTaps[0] + center[x]*colTaps[1] + down[x]*colTaps[2]) * scale / divide;
+	}
+}
+
+unsigned int separableRow[3], separableCol[3]; // found by fitsSeparable()
+
+void blurCenterSeparable(unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1) {
+	separableCenter(x0, x1, y0, y1, separableRow, separableCol, 1, blurDivide);
+}
+
+// Sums of 3 both ways and a single multiplication
+void blurCenterBox(unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1) {
+	static const unsigned int ones[3] = {1, 1, 1};
+	separableCenter(x0, x1, y0, y1, ones, ones, blurKernel[0], blurDivide);
+}
+
+// The default kernel, [2,1,2] both ways, with everything folded in
+BLUR_CENTER_VARIANTS(blurCenterDefault)
+static inline void blurCenterDefaultBody(unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1) {
+	static const unsigned int taps[3] = {2, 1, 2};
+	separableCenter(x0, x1, y0, y1, taps, taps, 1, 25);
+}
+
+int fitsDefault() {
+	return !memcmp(blurKernel, defaultBlurKernel, sizeof(defaultBlurKernel)) && blurDivide == 25;
+}
+
+int fitsBox() {
+	for (int i=1; i<9; i++) {
+		if (blurKernel[i] != blurKernel[0])
+			return 0;
+	}
+	return 1;
+}
+
+// Whether blurKernel is a column of taps times a row of them, which it finds
+int fitsSeparable() {
+	int r = 0, c = 0;
+	while (r < 3 && !blurKernel[r*3] && !blurKernel[r*3+1] && !blurKernel[r*3+2])
+		r++;
+	if (r == 3)
+		return 0;
+	// The row is the first row that isn't 0, divided by the greatest common divisor of its taps
+	unsigned int divisor = 0;
 	for (int i=0; i<3; i++) {
-		temp = cc[i]*(blurKernel[4]+blurKernel[5]+blurKernel[7]+blurKernel[8]) +
-			uc[i]*(blurKernel[1]+blurKernel[2]) + cl[i]*(blurKernel[3]+blurKernel[6]) + cc[i]*blurKernel[0];
-		target[i] = temp / blurDivide;
-	}
-
-	// edges
-	for (unsigned int x=1; x<xSize-1; x++) { // up edge
-		target = (unsigned char*) (tempBuf1 + pixel(x, 0));
-		cl = (unsigned char*) (tempBuf2 + pixel(x-1, 0));
-		cc = (unsigned char*) (tempBuf2 + pixel(x, 0));
-		cr = (unsigned char*) (tempBuf2 + pixel(x+1, 0));
-		dl = (unsigned char*) (tempBuf2 + pixel(x-1, 1));
-		dc = (unsigned char*) (tempBuf2 + pixel(x, 1));
-		dr = (unsigned char*) (tempBuf2 + pixel(x+1, 1));
-		for (int i=0; i<3; i++) {
-			temp = cc[i]*(blurKernel[1]+blurKernel[4]) + cl[i]*(blurKernel[0]+blurKernel[3]) +
-				cr[i]*(blurKernel[2]+blurKernel[5]) + dl[i]*blurKernel[6] + dc[i]*blurKernel[7] + dr[i]*blurKernel[8];
-			target[i] = temp / blurDivide;
-		}
-	}
-	for (unsigned int x=1; x<xSize-1; x++) { // down edge
-		target = (unsigned char*) (tempBuf1 + pixel(x, ySize-1));
-		ul = (unsigned char*) (tempBuf2 + pixel(x-1, ySize-2));
-		uc = (unsigned char*) (tempBuf2 + pixel(x, ySize-2));
-		ur = (unsigned char*) (tempBuf2 + pixel(x+1, ySize-2));
-		cl = (unsigned char*) (tempBuf2 + pixel(x-1, ySize-1));
-		cc = (unsigned char*) (tempBuf2 + pixel(x, ySize-1));
-		cr = (unsigned char*) (tempBuf2 + pixel(x+1, ySize-1));
-		for (int i=0; i<3; i++) {
-			temp = cc[i]*(blurKernel[4]+blurKernel[7]) + cl[i]*(blurKernel[3]+blurKernel[6]) +
-				cr[i]*(blurKernel[5]+blurKernel[8]) + ul[i]*blurKernel[0] + uc[i]*blurKernel[1] + ur[i]*blurKernel[2];
-			target[i] = temp / blurDivide;
-		}
-	}
-	for (unsigned int y=1; y<ySize-1; y++) { // left edge
-		target = (unsigned char*) (tempBuf1 + pixel(0, y));
-		uc = (unsigned char*) (tempBuf2 + pixel(0, y-1));
-		ur = (unsigned char*) (tempBuf2 + pixel(1, y-1));
-		cc = (unsigned char*) (tempBuf2 + pixel(0, y));
-		cr = (unsigned char*) (tempBuf2 + pixel(1, y));
-		dc = (unsigned char*) (tempBuf2 + pixel(0, y+1));
-		dr = (unsigned char*) (tempBuf2 + pixel(1, y+1));
-		for (int i=0; i<3; i++) {
-			temp = cc[i]*(blurKernel[3]+blurKernel[4]) + uc[i]*(blurKernel[0]+blurKernel[1]) +
-				dc[i]*(blurKernel[6]+blurKernel[7]) + ur[i]*blurKernel[2] + cr[i]*blurKernel[5] + dr[i]*blurKernel[8];
-			target[i] = temp / blurDivide;
-		}
-	}
-	for (unsigned int y=1; y<ySize-1; y++) { // right edge
-		target = (unsigned char*) (tempBuf1 + pixel(xSize-1, y));
-		ul = (unsigned char*) (tempBuf2 + pixel(xSize-2, y-1));
-		uc = (unsigned char*) (tempBuf2 + pixel(xSize-1, y-1));
-		cl = (unsigned char*) (tempBuf2 + pixel(xSize-2, y));
-		cc = (unsigned char*) (tempBuf2 + pixel(xSize-1, y));
-		dl = (unsigned char*) (tempBuf2 + pixel(xSize-2, y+1));
-		dc = (unsigned char*) (tempBuf2 + pixel(xSize-1, y+1));
-		for (int i=0; i<3; i++) {
-			temp = cc[i]*(blurKernel[4]+blurKernel[5]) + uc[i]*(blurKernel[1]+blurKernel[2]) +
-				dc[i]*(blurKernel[7]+blurKernel[8]) + ul[i]*blurKernel[0] + cl[i]*blurKernel[3] + dl[i]*blurKernel[6];
-			target[i] = temp / blurDivide;
-		}
-	}
-
-	// center
-	for (unsigned int x=1; x<xSize-1; x++) {
-		for (unsigned int y=1; y<ySize-1; y++) {
-			target = (unsigned char*) (tempBuf1 + pixel(x, y));
-			ul = (unsigned char*) (tempBuf2 + pixel(x-1, y-1));
-			uc = (unsigned char*) (tempBuf2 + pixel(x, y-1));
-			ur = (unsigned char*) (tempBuf2 + pixel(x+1, y-1));
-			cl = (unsigned char*) (tempBuf2 + pixel(x-1, y));
-			cc = (unsigned char*) (tempBuf2 + pixel(x, y));
-			cr = (unsigned char*) (tempBuf2 + pixel(x+1, y));
-			dl = (unsigned char*) (tempBuf2 + pixel(x-1, y+1));
-			dc = (unsigned char*) (tempBuf2 + pixel(x, y+1));
-			dr = (unsigned char*) (tempBuf2 + pixel(x+1, y+1));
-			for (int i=0; i<3; i++) {
-				temp = ul[i]*blurKernel[0] + uc[i]*blurKernel[1] + ur[i]*blurKernel[2] +
-					cl[i]*blurKernel[3] + cc[i]*blurKernel[4] + cr[i]*blurKernel[5] +
-					dl[i]*blurKernel[6] + dc[i]*blurKernel[7] + dr[i]*blurKernel[8];
-				target[i] = temp / blurDivide;
+		for (unsigned int a=divisor, b=blurKernel[r*3+i]; ; ) {
+			if (!b) {
+				divisor = a;
+				break;
+			}
+			unsigned int t = a % b;
+			a = b;
+			b = t;
+		}
+	}
+	for (int i=0; i<3; i++)
+		separableRow[i] = blurKernel[r*3+i] / divisor;
+	while (!separableRow[c])
+		c++;
+	for (int i=0; i<3; i++)
+		separableCol[i] = blurKernel[i*3+c] / separableRow[c];
+	for (int i=0; i<9; i++) {
+		if (blurKernel[i] != separableCol[i/3] * separableRow[i%3])
+			return 0;
+	}
+	return 1;
+}
+
+int fitsSymmetric() {
+	return blurKernel[2] == blurKernel[0] && blurKernel[6] == blurKernel[0] && blurKernel[8] == blurKernel[0] &&
+		blurKernel[3] == blurKernel[1] && blurKernel[5] == blurKernel[1] && blurKernel[7] == blurKernel[1];
+}
+
+int fitsAny() {
+	return 1;
+}
+
+// Implementations of the center of the blur from the most to the least specialized
+const blurKernelClass blurKernelClasses[] = {
+	{"default", fitsDefault, NULL, blurCenterDefaultVariants},
+	{"box", fitsBox, blurCenterBox, NULL},
+	{"separable", fitsSeparable, blurCenterSeparable, NULL},
+	{"symmetric", fitsSymmetric, blurCenterSymmetric, NULL},
+	{"general", fitsAny, blurCenterGeneral, NULL}
+};
+const int blurKernelClassCount = sizeof(blurKernelClasses) / sizeof(blurKernelClasses[0]);
+
+blurCenterFunc classBlurCenter(const blurKernelClass *kernelClass) {
+	return kernelClass->simdBlurCenter ? kernelClass->simdBlurCenter[simdLevel] : kernelClass->blurCenter;
+}
+
+// Uses the first implementation blurKernel fits
+void selectBlurKernel() {
+	for (int i=0; i<blurKernelClassCount; i++) {
+		if (blurKernelClasses[i].fits()) {
+			blurCenter = classBlurCenter(blurKernelClasses + i);
+			printf("Blurring with the %s kernel implementation\n", blurKernelClasses[i].name);
+			return;
+		}
+	}
+}
+
+// Replaces blurKernel with the one in SLIME_KERNEL, if it's set
+void readBlurKernel() {
+	const char *weights = getenv("SLIME_KERNEL");
+	if (!weights)
+		return;
+	unsigned int *k = blurKernel;
+	int length = 0;
+	if (sscanf(weights, "%u,%u,%u,%u,%u,%u,%u,%u,%u%n", k, k+1, k+2, k+3, k+4, k+5, k+6, k+7, k+8, &length) != 9 ||
+			weights[length]) {
+		fprintf(stderr, "SLIME_KERNEL should be 9 comma separated weights, row by row\n");
+		exit(1);
+	}
+	blurDivide = 0;
+	for (int i=0; i<9; i++)
+		blurDivide += blurKernel[i];
+	if (!blurDivide) {
+		fprintf(stderr, "SLIME_KERNEL can't be all 0\n");
+		exit(1);
+	}
+}
+
+// Fills the halo around buf with the pixels past the edges: the edge pixels themselves, or with wrapEdges the
+// ones on the other side. Then the blur needs no special case at the edges
+void refreshHalo(uint8_t *buf) {
+	for (unsigned int y=0; y<ySize; y++) {
+		uint8_t *row = buf + pixel(0, y);
+		row[-1] = wrapEdges ? row[xSize-1] : row[0];
+		row[xSize] = wrapEdges ? row[0] : row[xSize-1];
+	}
+	// Corners included
+	uint8_t *top = buf + pixel(0, 0) - 1, *bottom = buf + pixel(0, ySize-1) - 1;
+	memcpy(top - trailStride, wrapEdges ? bottom : top, xSize + 2);
+	memcpy(bottom + trailStride, wrapEdges ? top : bottom, xSize + 2);
+}
+
+// Tiles that can only come out black are cleared once and skipped after that
+void blurTileRow(unsigned int ty) {
+	unsigned int y0 = ty*TILE_SIZE, y1 = min(y0 + TILE_SIZE, ySize);
+	for (unsigned int tx=0; tx<tilesX; tx++) {
+		unsigned int x0 = tx*TILE_SIZE, x1 = min(x0 + TILE_SIZE, xSize);
+		unsigned int tile = ty*tilesX + tx;
+		if (!nearActiveTile(tx, ty)) {
+			if (tiles1[tile]) {
+				for (unsigned int y=y0; y<y1; y++)
+					memset(tempBuf1 + pixel(x0, y), 0, x1 - x0);
 			}
+			tiles1[tile] = 0;
+			continue;
 		}
+		tiles1[tile] = 1;
+		blurCenter(x0, x1, y0, y1);
 	}
 }
 
+void blurStrip(int worker, void *arg) {
+	(void) arg;
+	unsigned int begin, end;
+	workerRows(worker, &begin, &end);
+	for (unsigned int ty=begin/TILE_SIZE; ty*TILE_SIZE<end; ty++)
+		blurTileRow(ty);
+}
+
+void blur() {
+	refreshHalo(tempBuf2);
+	runOnWorkers(blurStrip, NULL);
+}
+
+uint32_t satAt(int x, int y) {
+	if (x < 0 || y < 0)
+		return 0;
+	return satTable[y*xSize + x];
+}
+
+// Same as the diffusion compute shader: box blur of tempBuf2 into tempBuf1 through a summed-area table.
+// Boxes are cut off at the edges and averaged over what is left of them. Table values can wrap around,
+// but box sums fit in 32 bits, so the differences still come out exact
+void boxBlur() {
+	for (unsigned int y=0; y<ySize; y++) {
+		uint32_t rowSum = 0;
+		uint32_t *row = satTable + y*xSize;
+		uint32_t *above = row - xSize;
+		for (unsigned int x=0; x<xSize; x++) {
+			rowSum += tempBuf2[pixel(x, y)];
+			row[x] = rowSum + (y ? above[x] : 0);
+		}
+	}
+
+	for (int y=0; y<(int)ySize; y++) {
+		int lowY = max(y - boxRadius, 0) - 1;
+		int highY = min(y + boxRadius, (int)ySize - 1);
+		for (int x=0; x<(int)xSize; x++) {
+			int lowX = max(x - boxRadius, 0) - 1;
+			int highX = min(x + boxRadius, (int)xSize - 1);
+			uint32_t area = (highX - lowX) * (highY - lowY);
+			uint32_t sum = satAt(highX, highY) - satAt(lowX, highY) - satAt(highX, lowY) + satAt(lowX, lowY);
+			tempBuf1[pixel(x, y)] = (sum + area/2) / area;
+		}
+	}
+}
+
+// Also finds out which of the active tiles faded to black
+static inline __attribute__((always_inline)) void fadeTileRow(unsigned int ty) {
+	// Locals, since stores through the global uint8_t pointers could change the pointers and the fade for all
+	// the compiler knows, which keeps it from vectorizing
+	uint8_t *restrict trail = tempBuf1;
+	const uint8_t fadeBy = intensityFade;
+	unsigned int y1 = min((ty+1)*TILE_SIZE, ySize);
+	for (unsigned int tx=0; tx<tilesX; tx++) {
+		unsigned int tile = ty*tilesX + tx;
+		if (!tiles1[tile])
+			continue;
+		unsigned int x0 = tx*TILE_SIZE, width = min(x0 + TILE_SIZE, xSize) - x0;
+		uint8_t lit = 0;
+		for (unsigned int y=ty*TILE_SIZE; y<y1; y++) {
+			uint8_t *restrict row = trail + pixel(x0, y);
+			for (unsigned int x=0; x<width; x++) {
+				row[x] = row[x] > fadeBy ? row[x] - fadeBy : 0;
+				lit |= row[x];
+			}
+		}
+		tiles1[tile] = lit != 0;
+	}
+}
+
+SIMD_VARIANTS(fadeStrip, (int worker, void *arg), (worker, arg))
+static inline void fadeStripBody(int worker, void *arg) {
+	(void) arg;
+	unsigned int begin, end;
+	workerRows(worker, &begin, &end);
+	for (unsigned int ty=begin/TILE_SIZE; ty*TILE_SIZE<end; ty++)
+		fadeTileRow(ty);
+}
+
 void fade() {
-	for (unsigned int i=0; i<xSize*ySize; i++) {
-		unsigned char *color = (unsigned char*) (tempBuf1 + i);
-		// blue
-		color[0] = max(0, color[0] - blueFade);
-		// green
-		color[1] = max(0, color[1] - greenFade);
-		// red
-		color[2] = max(0, color[2] - redFade);
+	runOnWorkers(fadeStripVariants[simdLevel], NULL);
+}
+
+// Same as the top mip level on the GPU, but built directly since only that level is sensed
+void buildSensorMap() {
+	for (unsigned int i=0; i<sensorXSize*sensorYSize; i++)
+		sensorMap[i] = 0;
+	for (unsigned int y=0; y<ySize; y++) {
+		float *row = sensorMap + (y >> sensorLevel) * sensorXSize;
+		for (unsigned int x=0; x<xSize; x++)
+			row[x >> sensorLevel] += paletteLuma[sensedTrail[pixel(x, y)]];
 	}
+	// Squares hanging over the edge count the missing pixels as black. This only approximates the GPU, which samples
+	// its mip level bilinearly and rounds the level's size down, squeezing those edge pixels into the last texels
+	float scale = 1.0f / (1 << (2 * sensorLevel));
+	for (unsigned int i=0; i<sensorXSize*sensorYSize; i++)
+		sensorMap[i] *= scale;
 }
 
-void moveParticles() {
-	for (int i=0; i<particleCount; i++) {
+// Steers and moves particles begin to end. They only read the trail buffer, so every particle
+// senses the trails as they were before any of them moved, like on the GPU
+static inline __attribute__((always_inline)) void moveParticleRange(unsigned int *rng, unsigned int begin, unsigned int end) {
+	for (unsigned int i=begin; i<end; i++) {
 		particle *p = particles + i;
 
 		// Steer towards highest luma pixel some steps away in 3 directions
@@ -618,14 +2058,18 @@ void moveParticles() {
 		for (int j=0; j<3; j++) {
 			int lookPosX = p->posX + particleSpeed * steerLength * cos(angles[j]);
 			int lookPosY = p->posY + particleSpeed * steerLength * sin(angles[j]);
-			if (lookPosX < 0 || lookPosX > xSize-1 || lookPosY < 0 || lookPosY > ySize-1)
+			if (wrapEdges) {
+				lookPosX = (lookPosX % (int)xSize + (int)xSize) % (int)xSize;
+				lookPosY = (lookPosY % (int)ySize + (int)ySize) % (int)ySize;
+			} else if (lookPosX < 0 || lookPosX > xSize-1 || lookPosY < 0 || lookPosY > ySize-1) {
+				continue;
+			}
+			if (sensorLevel > 0) {
+				lumas[j] = sensorMap[(lookPosY >> sensorLevel) * sensorXSize + (lookPosX >> sensorLevel)];
 				continue;
+			}
 			pixels[j] = pixel(lookPosX, lookPosY);
-			// https://en.wikipedia.org/wiki/Luma_(video)
-			unsigned char *color = (unsigned char*) (tempBuf1 + pixels[j]);
-			lumas[j] += color[0] * 0.0722;
-			lumas[j] += color[1] * 0.7152;
-			lumas[j] += color[2] * 0.2126;
+			lumas[j] = paletteLuma[sensedTrail[pixels[j]]];
 		}
 		if (lumas[0] > lumas[1] && lumas[0] > lumas[2]) {
 			p->angle = angles[0];
@@ -639,12 +2083,17 @@ void moveParticles() {
 		}
 
 		// Change direction randomly a bit
-		p->angle += (rand() % 201 - 100) / (100.0 / maxRandRadianChange);
+		p->angle += (rand_r(rng) % 201 - 100) / (100.0 / maxRandRadianChange);
 		p->dirX = particleSpeed * cos(p->angle);
 		p->dirY = particleSpeed * sin(p->angle);
 
 		particles[i].posX += particles[i].dirX;
 		particles[i].posY += particles[i].dirY;
+		if (wrapEdges) {
+			particles[i].posX = fmod(particles[i].posX + xSize, xSize);
+			particles[i].posY = fmod(particles[i].posY + ySize, ySize);
+			continue;
+		}
 		if (particles[i].posX < 0) {
 			particles[i].posX = fabs(particles[i].posX);
 			particles[i].dirX *= -1;
@@ -665,20 +2114,386 @@ void moveParticles() {
 			particles[i].dirY *= -1;
 			particles[i].angle = particles[i].angle * -1;
 		}
+	}
+}
+
+// Part out of workerCount * MOVE_PARTS_PER_WORKER, the parts of a worker together are its workerRange()
+static inline __attribute__((always_inline)) void moveParticlesOfPart(int part) {
+	unsigned int begin, end;
+	partRange(part, workerCount * MOVE_PARTS_PER_WORKER, simParticleCount, &begin, &end);
+	moveParticleRange(&rngStates[part].state, begin, end);
+}
+
+// The particle loop doesn't vectorize, it branches and calls rand_r(), cos() and sin() for every particle, but the
+// newer levels still do its math in fewer instructions
+SIMD_VARIANTS(moveParticleChunk, (int worker, void *arg), (worker, arg))
+static inline void moveParticleChunkBody(int worker, void *arg) {
+	(void) arg;
+	for (int part=worker*MOVE_PARTS_PER_WORKER; part<(worker+1)*MOVE_PARTS_PER_WORKER; part++)
+		moveParticlesOfPart(part);
+}
 
-		tempBuf1[pixel((unsigned int)particles[i].posX, (unsigned int)particles[i].posY)] = particleColor;
+// Deposits are single random writes, cheaper to do in one place than to synchronize between workers
+void depositParticles() {
+	for (int i=0; i<simParticleCount; i++) {
+		unsigned int x = particles[i].posX, y = particles[i].posY;
+		tempBuf1[pixel(x, y)] = 255; // particleColor in the palette
+		tiles1[y / TILE_SIZE * tilesX + x / TILE_SIZE] = 1;
 	}
 }
 
-void draw(uint32_t *buf) {
+void moveParticles() {
+	sensedTrail = tempBuf1;
+	if (sensorLevel > 0)
+		buildSensorMap();
+	runOnWorkers(moveParticleChunkVariants[simdLevel], NULL);
+	depositParticles();
+}
+
+// Parts of the step task graph, see concurrentStep()
+SIMD_VARIANTS(diffuseTileRow, (int worker, int part, void *arg), (worker, part, arg))
+static inline void diffuseTileRowBody(int worker, int part, void *arg) {
+	(void) worker;
+	(void) arg;
+	blurTileRow(part);
+	fadeTileRow(part);
+}
+
+SIMD_VARIANTS(moveParticlePart, (int worker, int part, void *arg), (worker, part, arg))
+static inline void moveParticlePartBody(int worker, int part, void *arg) {
+	(void) worker;
+	(void) arg;
+	moveParticlesOfPart(part);
+}
+
+void depositTask(int worker, int part, void *arg) {
+	(void) worker;
+	(void) part;
+	(void) arg;
+	depositParticles();
+}
+
+// A whole step as a task graph on the workers: every tile row is blurred and faded while the particles move,
+// sensing tempBuf2 which nothing writes, and the deposits wait for both. Nothing waits for a whole stage
+// to finish before the next one starts
+void concurrentStep() {
 	swap(tempBuf1, tempBuf2);
-	
-	blur();
-	fade();
-	moveParticles();
+	swap(tiles1, tiles2);
+	refreshHalo(tempBuf2);
+	sensedTrail = tempBuf2;
+	if (sensorLevel > 0)
+		buildSensorMap();
+	task tasks[] = {
+		{.job = diffuseTileRowVariants[simdLevel], .parts = tilesY, .byOwner = 1}, // on the rows of workerRows()
+		{.job = moveParticlePartVariants[simdLevel], .parts = workerCount * MOVE_PARTS_PER_WORKER, .byOwner = 1},
+		{.job = depositTask, .parts = 1, .dependencies = {0, 1}, .dependencyCount = 2}
+	};
+	runTasks(tasks, sizeof(tasks) / sizeof(tasks[0]));
+}
 
-	// Copy final result
-	for (unsigned int i=0; i<xSize*ySize; i++) {
-		buf[i] = tempBuf1[i];
+// Moves the particles steps times sensing tempBuf1 as it is, keeping their deposits for diffuseBlock() instead.
+// Only approximates steps of their own, see diffusionBlock
+void moveParticlesBlock(int steps) {
+	unsigned int tileCount = tilesX * tilesY;
+	sensedTrail = tempBuf1;
+	if (sensorLevel > 0)
+		buildSensorMap();
+	for (int s=0; s<steps; s++) {
+		runOnWorkers(moveParticleChunkVariants[simdLevel], NULL);
+		// Counting sort by tile, every starts[t] ends up where tile t+1 starts and is shifted back after
+		uint32_t *starts = depositStarts + s*(tileCount + 1), *deposits = blockDeposits + s*simParticleCount;
+		memset(starts, 0, (tileCount + 1) * sizeof(uint32_t));
+		for (int i=0; i<simParticleCount; i++) {
+			unsigned int x = particles[i].posX, y = particles[i].posY;
+			starts[y / TILE_SIZE * tilesX + x / TILE_SIZE + 1]++;
+		}
+		for (unsigned int t=1; t<tileCount; t++)
+			starts[t] += starts[t-1];
+		for (int i=0; i<simParticleCount; i++) {
+			unsigned int x = particles[i].posX, y = particles[i].posY;
+			unsigned int tile = y / TILE_SIZE * tilesX + x / TILE_SIZE;
+			deposits[starts[tile]++] = x | y << 16;
+			tiles1[tile] = 1; // so the tile and its neighbors get diffused
+		}
+		memmove(starts + 1, starts, tileCount * sizeof(uint32_t));
+		starts[0] = 0;
+	}
+}
+
+// Where coordinate c of a scratch pixel is in the trail of size pixels
+static inline int blockCoord(int c, int size) {
+	if (wrapEdges)
+		return (c % size + size) % size;
+	return c < 0 ? 0 : c >= size ? size - 1 : c;
+}
+
+// Scratch pixels past the edges of the trail take the value of the edge, like the halo does
+static inline void clampScratch(uint8_t *scratch, int left, int top, int width, int height) {
+	int first = max(-left, 0), last = min((int)xSize - left, width) - 1;
+	for (int y=max(-top, 0); y<min((int)ySize - top, height); y++) {
+		uint8_t *row = scratch + y*BLOCK_SIDE;
+		for (int x=0; x<first; x++)
+			row[x] = row[first];
+		for (int x=last+1; x<width; x++)
+			row[x] = row[last];
 	}
+	for (int y=0; y<-top; y++)
+		memcpy(scratch + y*BLOCK_SIDE, scratch + -top*BLOCK_SIDE, width);
+	for (int y=(int)ySize-top; y<height; y++)
+		memcpy(scratch + y*BLOCK_SIDE, scratch + ((int)ySize-1-top)*BLOCK_SIDE, width);
+}
+
+// Blur and fade of columns x0 to x1 and rows y0 to y1 of the scratch source into target. Inlined, so the kernel
+// and divide of callers passing constants are folded in
+static inline __attribute__((always_inline)) void blockStep(const uint8_t *source, uint8_t *target,
+			int x0, int x1, int y0, int y1, const unsigned int kernel[9], unsigned int divide) {
+	for (int y=y0; y<y1; y++) {
+		const uint8_t *center = source + y*BLOCK_SIDE + x0 - 1, *up = center - BLOCK_SIDE, *down = center + BLOCK_SIDE;
+		uint8_t *out = target + y*BLOCK_SIDE + x0;
+		for (int x=0; x<x1-x0; x++) {
+			unsigned int temp = up[x]*kernel[0] + up[x+1]*kernel[1] + up[x+2]*kernel[2] +
+				center[x]*kernel[3] + center[x+1]*kernel[4] + center[x+2]*kernel[5] +
+				down[x]*kernel[6] + down[x+1]*kernel[7] + down[x+2]*kernel[8];
+			unsigned int blurred = temp / divide;
+			out[x] = blurred > (unsigned int)intensityFade ? blurred - intensityFade : 0;
+		}
+	}
+}
+
+// Runs blockSteps steps of blur, fade and deposits on tile (tx, ty) of tempBuf2 and blockSteps pixels around it,
+// then writes the tile to tempBuf1. Every step leaves one more pixel around the scratch wrong, the tile stays
+// right. Returns whether anything in the tile is lit
+static inline __attribute__((always_inline)) int blockTile(unsigned int tx, unsigned int ty) {
+	uint8_t scratch[2][BLOCK_SIDE * BLOCK_SIDE];
+	uint8_t *source = scratch[0], *target = scratch[1];
+	int k = blockSteps, x0 = tx*TILE_SIZE, y0 = ty*TILE_SIZE;
+	int tileWidth = min(x0 + TILE_SIZE, (int)xSize) - x0, tileHeight = min(y0 + TILE_SIZE, (int)ySize) - y0;
+	int left = x0 - k, top = y0 - k, width = tileWidth + 2*k, height = tileHeight + 2*k;
+	int crossesEdge = left < 0 || top < 0 || left + width > (int)xSize || top + height > (int)ySize;
+	for (int y=0; y<height; y++) {
+		const uint8_t *row = tempBuf2 + pixel(0, blockCoord(top + y, ySize));
+		for (int x=0; x<width; x++)
+			source[y*BLOCK_SIDE + x] = row[blockCoord(left + x, xSize)];
+	}
+	memset(target, 0, BLOCK_SIDE * BLOCK_SIDE);
+
+	unsigned int tileCount = tilesX * tilesY;
+	for (int s=0; s<k; s++) {
+		// Only what the next steps still need of it
+		if (blockDefaultKernel)
+			blockStep(source, target, s + 1, width - s - 1, s + 1, height - s - 1, defaultBlurKernel, 25);
+		else
+			blockStep(source, target, s + 1, width - s - 1, s + 1, height - s - 1, blurKernel, blurDivide);
+		// Deposits can only be in the tile or its neighbors, steps don't reach further
+		const uint32_t *starts = depositStarts + s*(tileCount + 1), *deposits = blockDeposits + s*simParticleCount;
+		for (int dy=-1; dy<=1; dy++) {
+			for (int dx=-1; dx<=1; dx++) {
+				int nx = tx + dx, ny = ty + dy;
+				if (wrapEdges) {
+					nx = (nx + tilesX) % tilesX;
+					ny = (ny + tilesY) % tilesY;
+				} else if (nx < 0 || nx >= (int)tilesX || ny < 0 || ny >= (int)tilesY) {
+					continue;
+				}
+				unsigned int tile = ny*tilesX + nx;
+				for (uint32_t d=starts[tile]; d<starts[tile+1]; d++) {
+					int x = (int)(deposits[d] & 0xFFFF) - left, y = (int)(deposits[d] >> 16) - top;
+					if (wrapEdges) {
+						x = (x % (int)xSize + (int)xSize) % (int)xSize;
+						y = (y % (int)ySize + (int)ySize) % (int)ySize;
+					}
+					if (x >= 0 && x < width && y >= 0 && y < height)
+						target[y*BLOCK_SIDE + x] = 255;
+				}
+			}
+		}
+		if (crossesEdge && !wrapEdges)
+			clampScratch(target, left, top, width, height);
+		swap(source, target);
+	}
+
+	unsigned int lit = 0;
+	for (int y=0; y<tileHeight; y++) {
+		const uint8_t *row = source + (y + k)*BLOCK_SIDE + k;
+		memcpy(tempBuf1 + pixel(x0, y0 + y), row, tileWidth);
+		for (int x=0; x<tileWidth; x++)
+			lit |= row[x];
+	}
+	return lit != 0;
+}
+
+// Tiles that can only come out black are cleared like in blurStrip()
+SIMD_VARIANTS(diffuseBlockStrip, (int worker, void *arg), (worker, arg))
+static inline void diffuseBlockStripBody(int worker, void *arg) {
+	(void) arg;
+	unsigned int begin, end;
+	workerRows(worker, &begin, &end);
+	for (unsigned int ty=begin/TILE_SIZE; ty*TILE_SIZE<end; ty++) {
+		unsigned int y0 = ty*TILE_SIZE, y1 = min(y0 + TILE_SIZE, ySize);
+		for (unsigned int tx=0; tx<tilesX; tx++) {
+			unsigned int x0 = tx*TILE_SIZE, x1 = min(x0 + TILE_SIZE, xSize);
+			unsigned int tile = ty*tilesX + tx;
+			if (!nearActiveTile(tx, ty)) {
+				if (tiles1[tile]) {
+					for (unsigned int y=y0; y<y1; y++)
+						memset(tempBuf1 + pixel(x0, y), 0, x1 - x0);
+				}
+				tiles1[tile] = 0;
+				continue;
+			}
+			tiles1[tile] = blockTile(tx, ty);
+		}
+	}
+}
+
+// steps steps of blur, fade and the deposits moveParticlesBlock() kept, from tempBuf1 into tempBuf1. Each tile
+// is read from memory and written back once for all of them
+void diffuseBlock(int steps) {
+	swap(tempBuf1, tempBuf2);
+	swap(tiles1, tiles2);
+	blockSteps = steps;
+	blockDefaultKernel = fitsDefault();
+	runOnWorkers(diffuseBlockStripVariants[simdLevel], NULL);
+}
+
+// For every one of screenCount pixels, the first of the two of simCount pixels it's linearly filtered from and
+// the weight of the second one out of 256, with pixel centers lined up like the Vulkan blit does it
+void getScaleWeights(unsigned int *first, unsigned int *weight, unsigned int screenCount, unsigned int simCount) {
+	for (unsigned int i=0; i<screenCount; i++) {
+		double pos = (i + 0.5) * simCount / screenCount - 0.5;
+		pos = fmin(fmax(pos, 0.0), simCount - 1.0);
+		first[i] = min((unsigned int) pos, simCount > 1 ? simCount - 2 : 0);
+		weight[i] = simCount > 1 ? (pos - first[i]) * 256 : 0;
+	}
+}
+
+static inline __attribute__((always_inline)) void scaleRowBytes(uint32_t *restrict target, const uint8_t *restrict up,
+			const uint8_t *restrict down, const unsigned int *restrict x0s, const unsigned int *restrict weights,
+			const uint32_t *restrict colors, unsigned int width, unsigned int rowWeight) {
+	unsigned int rightStep = xSize > 1;
+	for (unsigned int x=0; x<width; x++) {
+		unsigned int left = x0s[x], right = left + rightStep;
+		unsigned int colWeight = weights[x];
+		unsigned int upMix = up[left] * (256 - colWeight) + up[right] * colWeight;
+		unsigned int downMix = down[left] * (256 - colWeight) + down[right] * colWeight;
+		target[x] = colors[(upMix * (256 - rowWeight) + downMix * rowWeight) >> 16];
+	}
+}
+
+// Same, but both taps of a row come from one 32 bit load at the left one, which x86 can gather unlike single bytes.
+// It reads past the right edge into the halo, where the weight of the right tap is 0 for a trail 1 pixel wide
+typedef uint32_t __attribute__((may_alias, aligned(1))) trailWord;
+
+static inline __attribute__((always_inline)) void scaleRowGather(uint32_t *restrict target, const uint8_t *restrict up,
+			const uint8_t *restrict down, const unsigned int *restrict x0s, const unsigned int *restrict weights,
+			const uint32_t *restrict colors, unsigned int width, unsigned int rowWeight) {
+	for (unsigned int x=0; x<width; x++) {
+		unsigned int colWeight = weights[x];
+		uint32_t upTaps = *(const trailWord*) (up + x0s[x]), downTaps = *(const trailWord*) (down + x0s[x]);
+		unsigned int upMix = (upTaps & 0xFF) * (256 - colWeight) + (upTaps >> 8 & 0xFF) * colWeight;
+		unsigned int downMix = (downTaps & 0xFF) * (256 - colWeight) + (downTaps >> 8 & 0xFF) * colWeight;
+		target[x] = colors[(upMix * (256 - rowWeight) + downMix * rowWeight) >> 16];
+	}
+}
+
+// Bilinear scale of tempBuf1 to the screen, writing the slice of output to its buffer buf. Intensities are
+// filtered and then colored, a single lookup per screen pixel. The restrict
+// parameters of the rows let them vectorize
+static inline __attribute__((always_inline)) void scaleToScreen(uint32_t *buf, int output) {
+	unsigned int width = outputXSizes[output], xOffset = outputXOffsets[output];
+	for (unsigned int y=0; y<outputYSizes[output]; y++) {
+		const uint8_t *up = tempBuf1 + pixel(0, scaleY0[y]), *down = ySize > 1 ? up + trailStride : up;
+		// SSE2 has no gathers, and emulating them is slower than loading the bytes
+		if (simdLevel > SIMD_SSE2)
+			scaleRowGather(buf + y*width, up, down, scaleX0 + xOffset, scaleWX + xOffset, palette, width, scaleWY[y]);
+		else
+			scaleRowBytes(buf + y*width, up, down, scaleX0 + xOffset, scaleWX + xOffset, palette, width, scaleWY[y]);
+	}
+}
+
+// Adds the time since the previous stage ended to stage, and its hardware counts while profiling
+void endStage(int stage) {
+	unsigned long long now = getMicros();
+	frameTelemetry.stageMicros[stage] += now - stageStart;
+	stageStart = now;
+	if (profiling) {
+		static perfReading reading;
+		uint64_t counts[PERF_COUNTERS];
+		readPerfCounters(&reading);
+		perfCountsBetween(&stageStartReading, &reading, counts);
+		for (int i=0; i<PERF_COUNTERS; i++)
+			stageCounts[stage][i] += counts[i];
+		stageStartReading = reading;
+	}
+}
+
+// Stage times add up over the substeps of the frame
+void draw() {
+	for (int i=STAGE_DIFFUSE; i<=STAGE_COPY; i++)
+		frameTelemetry.stageMicros[i] = 0;
+	stageStart = getMicros();
+	if (profiling)
+		readPerfCounters(&stageStartReading);
+	int blocked = diffusionMode == 0 && simDiffusionBlock > 1;
+	int concurrent = diffusionMode == 0 && !blocked && concurrentStages;
+	// Fading is part of the diffusion there
+	for (int i=0; blocked && i<substeps; i+=simDiffusionBlock) {
+		int steps = min(simDiffusionBlock, substeps - i);
+		moveParticlesBlock(steps);
+		endStage(STAGE_MOVE);
+		diffuseBlock(steps);
+		endStage(STAGE_DIFFUSE);
+	}
+	// The stages overlap, it all counts as diffusion
+	for (int i=0; concurrent && i<substeps; i++) {
+		concurrentStep();
+		endStage(STAGE_DIFFUSE);
+	}
+	for (int i=0; !blocked && !concurrent && i<substeps; i++) {
+		swap(tempBuf1, tempBuf2);
+		swap(tiles1, tiles2);
+
+		if (diffusionMode == 0) {
+			blur();
+		} else {
+			for (int j=0; j<(diffusionMode == 2 ? boxIterations : 1); j++) {
+				if (j)
+					swap(tempBuf1, tempBuf2);
+				boxBlur();
+			}
+			// Box blurs reach further than a tile and aren't done by tiles
+			markAllTiles();
+		}
+		endStage(STAGE_DIFFUSE);
+		fade();
+		endStage(STAGE_FADE);
+		moveParticles();
+		endStage(STAGE_MOVE);
+	}
+	copyToScreen();
+	endStage(STAGE_COPY);
+}
+
+// Copy final result colored through the palette, every monitor gets its slice
+// Restrict parameters, so the compiler knows the stores don't change the palette or the trail and vectorizes it
+static inline __attribute__((always_inline)) void colorRow(uint32_t *restrict target, const uint8_t *restrict source,
+			const uint32_t *restrict colors, unsigned int width) {
+	for (unsigned int x=0; x<width; x++)
+		target[x] = colors[source[x]];
+}
+
+SIMD_VARIANTS(copyToScreen, (), ())
+static inline void copyToScreenBody() {
+	for (int o=0; o<outputCount; o++) {
+		if (scaleX0) {
+			scaleToScreen(backBufs[o], o);
+			continue;
+		}
+		for (unsigned int y=0; y<outputYSizes[o]; y++)
+			colorRow(backBufs[o] + y*outputXSizes[o], tempBuf1 + pixel(outputXOffsets[o], y), palette, outputXSizes[o]);
+	}
+}
+
+void copyToScreen() {
+	copyToScreenVariants[simdLevel]();
 }
@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "telemetry.h"
+
+static telemetryRing *ring;
+static uint64_t frames;
+
+// Reuses the ring left by an earlier run in place, readers still attached to it notice through its frame count going back
+void startTelemetry() {
+	int fd = shm_open(TELEMETRY_NAME, O_CREAT | O_RDWR, 0644);
+	if (fd < 0 || ftruncate(fd, sizeof(telemetryRing))) {
+		fprintf(stderr, "Couldn't create the telemetry shared memory, timings won't be reported\n");
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	ring = mmap(NULL, sizeof(telemetryRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED) {
+		ring = NULL;
+		fprintf(stderr, "Couldn't map the telemetry shared memory, timings won't be reported\n");
+		return;
+	}
+	frames = 0;
+	atomic_store_explicit(&ring->frames, 0, memory_order_release);
+	for (int i=0; i<TELEMETRY_CAPACITY; i++)
+		atomic_store_explicit(&ring->slots[i].sequence, 0, memory_order_relaxed);
+	ring->version = TELEMETRY_VERSION;
+	ring->capacity = TELEMETRY_CAPACITY;
+	atomic_store_explicit(&ring->magic, TELEMETRY_MAGIC, memory_order_release);
+}
+
+// Never blocks. Fills in the frame number and timestamp of record
+void publishTelemetry(telemetryRecord *record) {
+	if (!ring)
+		return;
+	struct timespec tms;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tms);
+	record->timestamp = tms.tv_sec*1000000llu + tms.tv_nsec/1000llu;
+	record->frame = frames;
+
+	telemetrySlot *slot = ring->slots + frames % TELEMETRY_CAPACITY;
+	atomic_store_explicit(&slot->sequence, 2*frames + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(&slot->record, record, sizeof(telemetryRecord));
+	atomic_store_explicit(&slot->sequence, 2*frames + 2, memory_order_release);
+	frames++;
+	atomic_store_explicit(&ring->frames, frames, memory_order_release);
+}
+
+void stopTelemetry() {
+	if (!ring)
+		return;
+	// Left linked, so readers keep following it into the next run
+	munmap(ring, sizeof(telemetryRing));
+	ring = NULL;
+}
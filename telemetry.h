@@ -0,0 +1,49 @@
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Frame timings go to a ring of records in shared memory instead of stdout. The simulation is the only
+// writer and never waits for readers: slow ones just miss records that were overwritten in the meantime
+#define TELEMETRY_NAME "/slime-telemetry"
+#define TELEMETRY_MAGIC 0x534C494D45544C4Dull
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_CAPACITY 1024 // records, a power of 2
+
+// Parts of a frame, each backend only times some of them
+enum {
+	STAGE_DIFFUSE, // CPU blur or box blurs
+	STAGE_FADE,
+	STAGE_MOVE, // CPU particle steering, moving and depositing
+	STAGE_COPY, // CPU copy to the dumb buffers
+	STAGE_STEPS, // Vulkan wait for every simulation step of the frame
+	STAGE_PRESENT, // Vulkan acquire, copy to the swapchains and present
+	STAGE_COUNT
+};
+
+typedef struct {
+	uint64_t frame;
+	uint64_t timestamp; // CLOCK_MONOTONIC_RAW microseconds when the frame ended
+	uint32_t frameMicros;
+	uint32_t stageMicros[STAGE_COUNT];
+	uint32_t staleVblanks; // since the start, vblanks without a new frame, whether or not one was ready to flip to
+	uint32_t particleCount;
+	uint32_t substeps;
+} telemetryRecord;
+
+// Sequence is odd while the record is being written, and 2*(frame+1) once frame is complete in it
+typedef struct {
+	atomic_uint_fast64_t sequence;
+	telemetryRecord record;
+} telemetrySlot;
+
+// The simulation reuses the same ring across runs, resetting frames to 0 when it starts again.
+// Magic is stored last, so a reader that sees it finds the rest of the header valid
+typedef struct {
+	atomic_uint_fast64_t magic;
+	uint32_t version, capacity;
+	atomic_uint_fast64_t frames; // records written so far
+	telemetrySlot slots[TELEMETRY_CAPACITY];
+} telemetryRing;
+
+void startTelemetry();
+void publishTelemetry(telemetryRecord *record);
+void stopTelemetry();
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "telemetry.h"
+
+// Prints the frame records published by a running ./output, one line per frame.
+// Attaches read only, so it can never slow the simulation down or corrupt the ring
+
+static const char *stageNames[STAGE_COUNT] = {"diffuse", "fade", "move", "copy", "steps", "present"};
+static const int pollMicros = 2000;
+
+// Waits for the simulation to create the ring and finish setting up its header
+static const telemetryRing *attach() {
+	int fd;
+	struct stat st;
+	while ((fd = shm_open(TELEMETRY_NAME, O_RDONLY, 0)) < 0 || fstat(fd, &st) || st.st_size < (off_t) sizeof(telemetryRing)) {
+		if (fd >= 0)
+			close(fd);
+		usleep(100000);
+	}
+	const telemetryRing *ring = mmap(NULL, sizeof(telemetryRing), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map %s\n", TELEMETRY_NAME);
+		exit(1);
+	}
+	uint64_t magic;
+	while (!(magic = atomic_load_explicit((atomic_uint_fast64_t*) &ring->magic, memory_order_acquire)))
+		usleep(100000);
+	if (magic != TELEMETRY_MAGIC || ring->version != TELEMETRY_VERSION || ring->capacity != TELEMETRY_CAPACITY) {
+		fprintf(stderr, "%s is from a different version of the simulation\n", TELEMETRY_NAME);
+		exit(1);
+	}
+	return ring;
+}
+
+// Copies out record frame, 0 if the writer overwrote or is overwriting it meanwhile
+static int readRecord(const telemetryRing *ring, uint64_t frame, telemetryRecord *record) {
+	const telemetrySlot *slot = ring->slots + frame % TELEMETRY_CAPACITY;
+	uint64_t before = atomic_load_explicit((atomic_uint_fast64_t*) &slot->sequence, memory_order_acquire);
+	if (before != 2*frame + 2)
+		return 0;
+	memcpy(record, &slot->record, sizeof(telemetryRecord));
+	atomic_thread_fence(memory_order_acquire);
+	uint64_t after = atomic_load_explicit((atomic_uint_fast64_t*) &slot->sequence, memory_order_relaxed);
+	return after == before;
+}
+
+static void printRecord(const telemetryRecord *record) {
+	printf("frame %llu: %u us for %u steps of %u particles", (unsigned long long) record->frame,
+			record->frameMicros, record->substeps, record->particleCount);
+	for (int i=0; i<STAGE_COUNT; i++) {
+		if (record->stageMicros[i])
+			printf(", %s %u", stageNames[i], record->stageMicros[i]);
+	}
+	printf(", %u vblanks without a new frame\n", record->staleVblanks);
+}
+
+int main() {
+	const telemetryRing *ring = attach();
+	// Start from the newest record, older ones are from before the reader was interested
+	uint64_t next = atomic_load_explicit((atomic_uint_fast64_t*) &ring->frames, memory_order_acquire);
+	unsigned long long dropped = 0;
+
+	while (1) {
+		uint64_t written = atomic_load_explicit((atomic_uint_fast64_t*) &ring->frames, memory_order_acquire);
+		if (written < next) {
+			// The simulation restarted and reset the ring
+			munmap((void*) ring, sizeof(telemetryRing));
+			ring = attach();
+			next = 0;
+			continue;
+		}
+		if (written == next) {
+			fflush(stdout);
+			usleep(pollMicros);
+			continue;
+		}
+		// Records more than a lap behind are gone already
+		if (written - next > TELEMETRY_CAPACITY) {
+			dropped += written - TELEMETRY_CAPACITY - next;
+			next = written - TELEMETRY_CAPACITY;
+		}
+		telemetryRecord record;
+		if (readRecord(ring, next, &record)) {
+			printRecord(&record);
+		} else {
+			dropped++;
+			fprintf(stderr, "%llu records dropped so far\n", dropped);
+		}
+		next++;
+	}
+	return 0;
+}
@@ -1,5 +1,6 @@
 #include <vulkan/vulkan.h>
 #include "drmMaster.h"
+#include "deviceMemory.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -11,19 +12,25 @@ uint32_t qFamGraphicsIndex, qFamComputeIndex, qFamTransferIndex;
 unsigned int hostMemTypeIndex, largeMemTypeIndex;
 VkMemoryType hostMemType, largeMemType;
 VkMemoryHeap hostMemHeap, largeMemHeap;
-VkDeviceMemory imgsMem, bufsMem;
 
-VkSurfaceKHR surface;
-VkSwapchainKHR swapchain;
-uint32_t imgCount;
-VkImage *images;
-VkExtent2D displayExtent;
+// One display surface and swapchain per monitor, each showing the slice of the screen-sized result
+// starting at displayXOffsets[i]
+int swapchainCount;
+VkSurfaceKHR surfaces[MAX_OUTPUTS];
+VkSwapchainKHR swapchains[MAX_OUTPUTS];
+uint32_t imgCounts[MAX_OUTPUTS];
+VkImage *images[MAX_OUTPUTS];
+VkExtent2D displayExtents[MAX_OUTPUTS];
+uint32_t displayXOffsets[MAX_OUTPUTS];
+static uint32_t usedPlanes; // bit i is set when plane i shows one of the monitors already
 VkDevice dev;
 uint32_t queueFamilyCount;
 VkQueueFamilyProperties *queueFamilies;
 VkQueue graphicsQueue, computeQueue, transferQueue;
-static int fd;
-uint32_t screenWidth, screenHeight, refreshRate;
+static int fd = -1;
+static int headless; // no display, swapchains or presentation, e.g. to compare with the CPU on lavapipe
+uint32_t screenWidth, screenHeight, refreshRate; // screen is all monitors side by side
+uint32_t simWidth, simHeight; // size of the trail images, scaled to the screen size when presenting
 
 typedef struct vertex_t {
 	float x;
@@ -31,34 +38,63 @@ typedef struct vertex_t {
 	float z;
 } vertex;
 typedef struct {
-	float posX, posY, dirX, dirY, angle;
-} vkParticle;
-extern const int particleCount;
+	uint32_t x, y;
+} vkParticle; // see vulkanSetup.h
+extern int simParticleCount;
 extern double particleSpeed;
 extern double steerAmplitude;
 extern int steerLength;
 extern double maxRandRadianChange;
 extern uint32_t particleColor;
 extern uint8_t redFade, greenFade, blueFade;
-extern const unsigned int blurKernel[9];
+extern unsigned int blurKernel[9];
 extern unsigned int blurDivide;
 extern unsigned int vkRandSeed;
-VkBuffer vertexBuf, particleBuf;
+extern const int sensorLevel;
+extern const int diffusionMode;
+extern const int boxRadius;
+extern const int computeOnlyFrames;
+extern const int activeTiles;
+extern const int spawnLayout;
+extern const unsigned int simulationWidth, simulationHeight;
+extern const double simulationScale;
+VkBuffer vertexBuf, particleBuf, stagingBuf;
+// The list of tiles to blur with the indirect dispatch arguments in front of it, then a lit map of
+// 16x16 tiles for each image, see tiles.comp. Always exists since the compute pipeline binds it
+#define BLUR_TILE_SIZE 16 // also written in the shaders
+VkBuffer tileBuf;
+VkDeviceSize litBackOffset, litFrontOffset;
+int tiledBlur; // activeTiles when it can be used
+uint32_t blurTilesX, blurTilesY;
 VkImage frontImg, backImg;
+VkImage outputImg; // screen sized copy of the result, only exists when simulating at a different size
 VkImageView frontImgView, backImgView;
-VkDeviceSize particlesOffset;
+VkImageView frontSensorView, backSensorView; // all mip levels, for particles to sense from
+VkSampler sensorSampler;
+VkImage satImg; // summed-area table for box diffusion, only exists when diffusionMode isn't 0
+VkImageView satImgView;
 vertex *mappedVertices;
-vkParticle *mappedParticles;
+uint32_t *mappedStaging;
+vkParticle *stagedParticles; // right after the trail in the staging buffer
+VkDeviceSize stagedParticlesOffset;
 
 VkDescriptorPool descriptorPool;
 VkPipeline computePipeline, graphicsPipeline;
-VkPipelineLayout computePipelineLayout, graphicsPipelineLayout;
+VkPipeline diffusionPipelines[3]; // row sums, column sums, box averages
+VkPipeline blurPipeline; // replaces the graphics pipeline when computeOnlyFrames or tiledBlur is set
+VkPipeline tilesPipeline; // lists the tiles to blur, only exists with tiledBlur
+VkPipeline initPipeline; // places the particles at startup, uses the layout and descriptor sets of computePipeline
+VkPipelineLayout computePipelineLayout, graphicsPipelineLayout, diffusionPipelineLayout, blurPipelineLayout;
+VkPipelineLayout tilesPipelineLayout;
 VkFramebuffer backFb, frontFb;
 VkRenderPass renderPass;
 VkDescriptorSet compBackToFront, compFrontToBack, graphicsBack, graphicsFront;
+VkDescriptorSet diffuseBack, diffuseFront;
+VkDescriptorSet blurBackToFront, blurFrontToBack;
+VkDescriptorSet tilesBackToFront, tilesFrontToBack;
 
 VkCommandPool computePool, graphicsPool, transferPool;
-VkSemaphore commandSem;
+VkSemaphore commandSem, acquireSems[MAX_OUTPUTS];
 VkFence swapFence, commandFence1, commandFence2;
 
 static VkResult result;
@@ -177,7 +213,7 @@ static void createInstance() {
 		"VK_EXT_direct_mode_display",
 		"VK_EXT_acquire_drm_display"
 	};
-	instInfo.enabledExtensionCount = sizeof(extNames) / sizeof(char *);
+	instInfo.enabledExtensionCount = headless ? 0 : sizeof(extNames) / sizeof(char *);
 	instInfo.ppEnabledExtensionNames = extNames;
 
 #ifdef DEBUG
@@ -301,6 +337,11 @@ void createLogicalDevice() {
 		queueInfos[qInfoIndex].pQueuePriorities = priorities;
 		qInfoIndex++;
 	}
+	// Simulation steps record compute dispatches and render passes in the same command buffer
+	if (!(queueFamilies[qFamGraphicsIndex].queueFlags & VK_QUEUE_COMPUTE_BIT)) {
+		fprintf(stderr, "The graphics queue family doesn't support compute\n");
+		abort();
+	}
 
 	// Save the type and heap of the largest device local memory heap and the first host visible and device local
 	// The largest device local heap will have the images
@@ -339,14 +380,14 @@ void createLogicalDevice() {
 	devInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
 	devInfo.pNext = NULL;
 	devInfo.flags = 0;
-	devInfo.queueCreateInfoCount = queueFamilyCount;
+	devInfo.queueCreateInfoCount = qInfoIndex;
 	devInfo.pQueueCreateInfos = queueInfos;
 	devInfo.enabledLayerCount = 0;
 	devInfo.ppEnabledLayerNames = NULL;
 	const char * const extNames[] = {
 		"VK_KHR_swapchain"
 	};
-	devInfo.enabledExtensionCount = sizeof(extNames) / sizeof(char *);
+	devInfo.enabledExtensionCount = headless ? 0 : sizeof(extNames) / sizeof(char *);
 	devInfo.ppEnabledExtensionNames = extNames;
 
 	devInfo.pEnabledFeatures = &requiredFeatures;
@@ -355,7 +396,7 @@ void createLogicalDevice() {
 	vkFail("Failed to create logical device\n");
 	physDev = devs[devInd];
 
-	for (unsigned int i=0; i<queueFamilyCount; i++) {
+	for (unsigned int i=0; i<qInfoIndex; i++) {
 		free((void *) queueInfos[i].pQueuePriorities);
 	}
 
@@ -364,7 +405,7 @@ void createLogicalDevice() {
 	vkGetDeviceQueue(dev, qFamTransferIndex, 0, &transferQueue);
 }
 
-void createDisplaySurface(int monitorIndex) {
+void createDisplaySurface(int monitorIndex, int output) {
 	getConnectorWithCrtc(monitorIndex);
 	VkDisplayKHR display;
 	result = vkGetDrmDisplay(physDev, fd, connector->connector_id, &display);
@@ -388,6 +429,8 @@ void createDisplaySurface(int monitorIndex) {
 	uint32_t planeIndex;
 	int foundPlane = 0;
 	for (planeIndex=0; planeIndex<planeCount; planeIndex++) {
+		if (usedPlanes & 1u<<planeIndex)
+			continue;
 		uint32_t displayCount;
 		result = vkGetDisplayPlaneSupportedDisplays(physDev, planeIndex, &displayCount, NULL);
 		if (result != VK_SUCCESS)
@@ -410,6 +453,7 @@ void createDisplaySurface(int monitorIndex) {
 		fprintf(stderr, "Couldn't find a suitable plane (crtc?) for the display");
 		abort();
 	}
+	usedPlanes |= 1u<<planeIndex;
 
 	// Choose a mode, the first one should be the best
 	VkDisplayModeKHR displayMode;
@@ -421,10 +465,11 @@ void createDisplaySurface(int monitorIndex) {
 	vkFail("Failed to get mode properties");
 	int modeIdx = 0;
 	displayMode = modes[modeIdx].displayMode;
-	screenWidth = modes[modeIdx].parameters.visibleRegion.width;
-	screenHeight = modes[modeIdx].parameters.visibleRegion.height;
-	refreshRate = modes[modeIdx].parameters.refreshRate;
-	printf("Chosen mode: %ux%u, %f fps\n", screenWidth, screenHeight, refreshRate/1000.0);
+	displayExtents[output] = modes[modeIdx].parameters.visibleRegion;
+	if (output == 0)
+		refreshRate = modes[modeIdx].parameters.refreshRate;
+	printf("Chosen mode: %ux%u, %f fps\n", displayExtents[output].width, displayExtents[output].height,
+			modes[modeIdx].parameters.refreshRate/1000.0);
 
 	VkDisplaySurfaceCreateInfoKHR surfaceCreateInfo;
 	surfaceCreateInfo.sType = VK_STRUCTURE_TYPE_DISPLAY_SURFACE_CREATE_INFO_KHR;
@@ -436,18 +481,17 @@ void createDisplaySurface(int monitorIndex) {
 	surfaceCreateInfo.transform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
 	surfaceCreateInfo.globalAlpha = 0.0;
 	surfaceCreateInfo.alphaMode = VK_DISPLAY_PLANE_ALPHA_OPAQUE_BIT_KHR; // no alpha
-	displayExtent = modes[modeIdx].parameters.visibleRegion;
-	surfaceCreateInfo.imageExtent = displayExtent;
+	surfaceCreateInfo.imageExtent = displayExtents[output];
 
-	result = vkCreateDisplayPlaneSurface(inst, &surfaceCreateInfo, NULL, &surface);
+	result = vkCreateDisplayPlaneSurface(inst, &surfaceCreateInfo, NULL, surfaces + output);
 	vkFail("Failed to create surface to display\n");
 }
 
-void createSwapchain() {
+void createSwapchain(int output) {
 	uint32_t formatCount;
-	vkGetPhysicalDeviceSurfaceFormats(physDev, surface, &formatCount, NULL);
+	vkGetPhysicalDeviceSurfaceFormats(physDev, surfaces[output], &formatCount, NULL);
 	VkSurfaceFormatKHR formats[formatCount];
-	vkGetPhysicalDeviceSurfaceFormats(physDev, surface, &formatCount, formats);
+	vkGetPhysicalDeviceSurfaceFormats(physDev, surfaces[output], &formatCount, formats);
 	int formatIndex = -1;
 	for (uint32_t i=0; i<formatCount; i++) {
 		if (formats[i].format == VK_FORMAT_R8G8B8A8_UNORM || formats[i].format == VK_FORMAT_B8G8R8A8_UNORM) {
@@ -464,11 +508,11 @@ void createSwapchain() {
 	swapchainCreateInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
 	swapchainCreateInfo.pNext = NULL;
 	swapchainCreateInfo.flags = 0;
-	swapchainCreateInfo.surface = surface;
+	swapchainCreateInfo.surface = surfaces[output];
 	swapchainCreateInfo.minImageCount = 2;
 	swapchainCreateInfo.imageFormat = formats[formatIndex].format;
 	swapchainCreateInfo.imageColorSpace = formats[formatIndex].colorSpace;
-	swapchainCreateInfo.imageExtent = displayExtent;
+	swapchainCreateInfo.imageExtent = displayExtents[output];
 	swapchainCreateInfo.imageArrayLayers = 1;
 	swapchainCreateInfo.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 	swapchainCreateInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
@@ -480,21 +524,21 @@ void createSwapchain() {
 	swapchainCreateInfo.clipped = VK_TRUE;
 	swapchainCreateInfo.oldSwapchain = 0;
 
-	result = vkCreateSwapchain(dev, &swapchainCreateInfo, NULL, &swapchain);
+	result = vkCreateSwapchain(dev, &swapchainCreateInfo, NULL, swapchains + output);
 	vkFail("Failed to create a swapchain\n");
 
-	result = vkGetSwapchainImages(dev, swapchain, &imgCount, NULL);
+	result = vkGetSwapchainImages(dev, swapchains[output], imgCounts + output, NULL);
 	vkFail("Failed to get swapchain image count\n");
-	images = malloc(imgCount * sizeof(VkImage));
-	result = vkGetSwapchainImages(dev, swapchain, &imgCount, images);
+	images[output] = malloc(imgCounts[output] * sizeof(VkImage));
+	result = vkGetSwapchainImages(dev, swapchains[output], imgCounts + output, images[output]);
 	vkFail("Failed to get swapchain images\n");
 }
 
 void createResources() {
 	// Images
 	VkExtent3D imgSize;
-	imgSize.width = screenWidth;
-	imgSize.height = screenHeight;
+	imgSize.width = simWidth;
+	imgSize.height = simHeight;
 	imgSize.depth = 1;
 
 	VkImageCreateInfo imgCreateInfo;
@@ -504,11 +548,11 @@ void createResources() {
 	imgCreateInfo.imageType = VK_IMAGE_TYPE_2D;
 	imgCreateInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
 	imgCreateInfo.extent = imgSize;
-	imgCreateInfo.mipLevels = 1;
+	imgCreateInfo.mipLevels = sensorLevel + 1; // the mip chain is generated every step with blits
 	imgCreateInfo.arrayLayers = 1;
 	imgCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
 	imgCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-	imgCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+	imgCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
 				VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
 				VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
 	imgCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
@@ -521,6 +565,25 @@ void createResources() {
 	result = vkCreateImage(dev, &imgCreateInfo, NULL, &backImg);
 	vkFail("Failed to create back image\n");
 
+	// Blits scale the result to it on the graphics queue, the copy to the swapchain stays a plain copy
+	if (simWidth != screenWidth || simHeight != screenHeight) {
+		imgCreateInfo.extent.width = screenWidth;
+		imgCreateInfo.extent.height = screenHeight;
+		imgCreateInfo.mipLevels = 1;
+		imgCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		result = vkCreateImage(dev, &imgCreateInfo, NULL, &outputImg);
+		vkFail("Failed to create output image\n");
+		imgCreateInfo.extent = imgSize;
+	}
+
+	if (diffusionMode) {
+		imgCreateInfo.format = VK_FORMAT_R32G32B32A32_UINT;
+		imgCreateInfo.mipLevels = 1;
+		imgCreateInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+		result = vkCreateImage(dev, &imgCreateInfo, NULL, &satImg);
+		vkFail("Failed to create summed-area table image\n");
+	}
+
 	// Buffers
 	VkBufferCreateInfo bufCreateInfo;
 	bufCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -534,53 +597,54 @@ void createResources() {
 	result = vkCreateBuffer(dev, &bufCreateInfo, NULL, &vertexBuf);
 	vkFail("Failed to create vertex buffer\n");
 
-	bufCreateInfo.size = sizeof(vkParticle) * particleCount;
-	bufCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	// Device local, init.comp fills it and the CPU only sees it through the staging buffer
+	bufCreateInfo.size = sizeof(vkParticle) * simParticleCount;
+	bufCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+				VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 	result = vkCreateBuffer(dev, &bufCreateInfo, NULL, &particleBuf);
 	vkFail("Failed to create particle buffer\n");
+
+	// Holds one trail image and the particles on their way between the CPU and the GPU: results read
+	// back without a display, and checkpoints both when saving and restoring them
+	stagedParticlesOffset = simWidth * simHeight * sizeof(uint32_t);
+	bufCreateInfo.size = stagedParticlesOffset + sizeof(vkParticle) * simParticleCount;
+	bufCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	result = vkCreateBuffer(dev, &bufCreateInfo, NULL, &stagingBuf);
+	vkFail("Failed to create staging buffer\n");
+
+	// The blur of a tile is a workgroup in a single row of them, so there can't be more than 65535 tiles.
+	// Box blurs go through every pixel anyway
+	blurTilesX = (simWidth + BLUR_TILE_SIZE - 1) / BLUR_TILE_SIZE;
+	blurTilesY = (simHeight + BLUR_TILE_SIZE - 1) / BLUR_TILE_SIZE;
+	tiledBlur = activeTiles && !diffusionMode && blurTilesX * blurTilesY <= 65535;
+	if (activeTiles && !tiledBlur)
+		printf("Blurring every tile, active tiles need diffusionMode 0 and at most 65535 tiles\n");
+	// Sections start at the largest offset alignment storage buffers can need
+	VkDeviceSize tileCount = blurTilesX * blurTilesY;
+	litBackOffset = (3 + tileCount) * sizeof(uint32_t);
+	litBackOffset = (litBackOffset + 255) / 256 * 256;
+	litFrontOffset = litBackOffset + (tileCount * sizeof(uint32_t) + 255) / 256 * 256;
+	bufCreateInfo.size = litFrontOffset + tileCount * sizeof(uint32_t);
+	bufCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+				VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	result = vkCreateBuffer(dev, &bufCreateInfo, NULL, &tileBuf);
+	vkFail("Failed to create tile buffer\n");
 }
 
 void allocDeviceMemory() {
-	VkMemoryAllocateInfo allocInfo;
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.pNext = NULL;
-
-	VkMemoryRequirements reqs;
-	vkGetImageMemoryRequirements(dev, backImg, &reqs);
-	if (!(reqs.memoryTypeBits & (1 << largeMemTypeIndex))) {
-		printf("Can't store images in large memory heap\n");
-		abort();
-	}
-	// both images are the same, assume same memory requirements
-	allocInfo.allocationSize = 2*reqs.size + 2*reqs.alignment;
-	allocInfo.memoryTypeIndex = largeMemTypeIndex;
-	result = vkAllocateMemory(dev, &allocInfo, NULL, &imgsMem);
-	vkFail("Failed to allocate device memory for images\n");
-	vkBindImageMemory(dev, backImg, imgsMem, 0);
-	vkFail("Failed to back backImg with memory\n");
-	vkBindImageMemory(dev, frontImg, imgsMem, (reqs.size / reqs.alignment + 1) * reqs.alignment);
-	vkFail("Failed to back frontImg with memory\n");
-
-	vkGetBufferMemoryRequirements(dev, vertexBuf, &reqs);
-	if (!(reqs.memoryTypeBits & (1 << hostMemTypeIndex))) {
-		printf("Can't store vertex buffer in host visible memory heap\n");
-		abort();
-	}
-	particlesOffset = reqs.size;
-	vkGetBufferMemoryRequirements(dev, particleBuf, &reqs);
-	if (!(reqs.memoryTypeBits & (1 << hostMemTypeIndex))) {
-		printf("Can't store particle buffer in host visible memory heap\n");
-		abort();
-	}
-	particlesOffset = (particlesOffset / reqs.alignment + 1 ) * reqs.alignment;
-	allocInfo.allocationSize = particlesOffset + reqs.size;
-	allocInfo.memoryTypeIndex = hostMemTypeIndex;
-	result = vkAllocateMemory(dev, &allocInfo, NULL, &bufsMem);
-	vkFail("Failed to allocate device memory for buffers\n");
-	vkBindBufferMemory(dev, vertexBuf, bufsMem, 0);
-	vkFail("Failed to back backImg with memory\n");
-	vkBindBufferMemory(dev, particleBuf, bufsMem, particlesOffset);
-	vkFail("Failed to back frontImg with memory\n");
+	initDeviceMemory(physDev, dev);
+	bindImage(backImg, largeMemTypeIndex, "back image");
+	bindImage(frontImg, largeMemTypeIndex, "front image");
+	if (outputImg)
+		bindImage(outputImg, largeMemTypeIndex, "output image");
+	if (diffusionMode)
+		bindImage(satImg, largeMemTypeIndex, "summed-area table");
+
+	mappedVertices = (vertex*) bindBuffer(vertexBuf, hostMemTypeIndex, "vertex buffer");
+	bindBuffer(particleBuf, largeMemTypeIndex, "particle buffer");
+	bindBuffer(tileBuf, largeMemTypeIndex, "tile buffer");
+	mappedStaging = (uint32_t*) bindBuffer(stagingBuf, hostMemTypeIndex, "staging buffer");
+	stagedParticles = (vkParticle*) ((char*) mappedStaging + stagedParticlesOffset);
 }
 
 void createViews() {
@@ -612,29 +676,62 @@ void createViews() {
 	imgViewInfo.image = backImg;
 	result = vkCreateImageView(dev, &imgViewInfo, NULL, &backImgView);
 	vkFail("Failed to create front image view\n");
-}
 
-void mapBufs() {
-	void *mappedMem;
-	vkMapMemory(dev, bufsMem, 0, VK_WHOLE_SIZE, 0, &mappedMem);
-	mappedVertices = (vertex*)mappedMem;
-	mappedParticles = (vkParticle*)(mappedMem + particlesOffset);
+	imgViewInfo.subresourceRange.levelCount = sensorLevel + 1;
+	result = vkCreateImageView(dev, &imgViewInfo, NULL, &backSensorView);
+	vkFail("Failed to create back sensor view\n");
+	imgViewInfo.image = frontImg;
+	result = vkCreateImageView(dev, &imgViewInfo, NULL, &frontSensorView);
+	vkFail("Failed to create front sensor view\n");
+
+	if (diffusionMode) {
+		imgViewInfo.image = satImg;
+		imgViewInfo.format = VK_FORMAT_R32G32B32A32_UINT;
+		imgViewInfo.subresourceRange.levelCount = 1;
+		result = vkCreateImageView(dev, &imgViewInfo, NULL, &satImgView);
+		vkFail("Failed to create summed-area table view\n");
+	}
+
+	// Linear filtering inside the chosen mip level, out of bounds senses nothing
+	VkSamplerCreateInfo samplerInfo;
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.pNext = NULL;
+	samplerInfo.flags = 0;
+	samplerInfo.magFilter = VK_FILTER_LINEAR;
+	samplerInfo.minFilter = VK_FILTER_LINEAR;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+	samplerInfo.mipLodBias = 0.0;
+	samplerInfo.anisotropyEnable = VK_FALSE;
+	samplerInfo.maxAnisotropy = 1.0;
+	samplerInfo.compareEnable = VK_FALSE;
+	samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+	samplerInfo.minLod = 0.0;
+	samplerInfo.maxLod = sensorLevel;
+	samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK;
+	samplerInfo.unnormalizedCoordinates = VK_FALSE;
+	result = vkCreateSampler(dev, &samplerInfo, NULL, &sensorSampler);
+	vkFail("Failed to create sensor sampler\n");
 }
 
 void createDescriptorPool() {
-	VkDescriptorPoolSize poolSizes[3];
+	VkDescriptorPoolSize poolSizes[4];
 	poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-	poolSizes[0].descriptorCount = 2;
+	poolSizes[0].descriptorCount = 14;
 	poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-	poolSizes[1].descriptorCount = 6;
+	poolSizes[1].descriptorCount = 12;
 	poolSizes[2].type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
 	poolSizes[2].descriptorCount = 2;
+	poolSizes[3].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSizes[3].descriptorCount = 2;
 
 	VkDescriptorPoolCreateInfo poolInfo;
 	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	poolInfo.pNext = NULL;
 	poolInfo.flags = 0;
-	poolInfo.maxSets = 4;
+	poolInfo.maxSets = 10;
 	poolInfo.poolSizeCount = sizeof(poolSizes) / sizeof(VkDescriptorPoolSize);
 	poolInfo.pPoolSizes = poolSizes;
 
@@ -643,27 +740,29 @@ void createDescriptorPool() {
 
 void createComputePipeline() {
 	// Descriptor set layout
-	VkDescriptorSetLayoutBinding bindings[3];
+	VkDescriptorSetLayoutBinding bindings[4];
 	bindings[0].binding = 0;
 	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER; // particle buffer
 	bindings[0].descriptorCount = 1;
 	bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 	bindings[0].pImmutableSamplers = NULL;
 	bindings[1].binding = 1;
-	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE; // read image
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE; // image to deposit particles in
 	bindings[1].descriptorCount = 1;
 	bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 	bindings[1].pImmutableSamplers = NULL;
 	bindings[2].binding = 2;
-	bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE; // write image
+	bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER; // image to sense from
 	bindings[2].descriptorCount = 1;
 	bindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 	bindings[2].pImmutableSamplers = NULL;
+	bindings[3] = bindings[0];
+	bindings[3].binding = 3; // lit tiles of the image to deposit particles in
 	VkDescriptorSetLayoutCreateInfo setLayoutInfo;
 	setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
 	setLayoutInfo.pNext = NULL;
 	setLayoutInfo.flags = 0;
-	setLayoutInfo.bindingCount = 3;
+	setLayoutInfo.bindingCount = 4;
 	setLayoutInfo.pBindings = bindings;
 
 	VkDescriptorSetLayout setLayout;
@@ -696,17 +795,21 @@ void createComputePipeline() {
 		unsigned int randSeed;
 		unsigned int scrW;
 		unsigned int scrH;
+		int sensLevel;
+		unsigned int markTiles;
 	} spec;
-	spec.pCount = particleCount;
+	spec.pCount = simParticleCount;
 	spec.pSpeed = particleSpeed;
 	spec.stAmp = steerAmplitude;
 	spec.stLen = steerLength;
 	spec.maxRand = maxRandRadianChange;
 	spec.randSeed = vkRandSeed;
-	spec.scrW = screenWidth;
-	spec.scrH = screenHeight;
+	spec.scrW = simWidth;
+	spec.scrH = simHeight;
+	spec.sensLevel = sensorLevel;
+	spec.markTiles = tiledBlur;
 
-	VkSpecializationMapEntry specializationEntries[8];
+	VkSpecializationMapEntry specializationEntries[10];
 	specializationEntries[0].constantID = 0;
 	specializationEntries[0].offset = offsetof(struct specConst, pCount);
 	specializationEntries[0].size = sizeof(int);
@@ -731,9 +834,15 @@ void createComputePipeline() {
 	specializationEntries[7].constantID = 7;
 	specializationEntries[7].offset = offsetof(struct specConst, scrH);
 	specializationEntries[7].size = sizeof(unsigned int);
+	specializationEntries[8].constantID = 8;
+	specializationEntries[8].offset = offsetof(struct specConst, sensLevel);
+	specializationEntries[8].size = sizeof(int);
+	specializationEntries[9].constantID = 9;
+	specializationEntries[9].offset = offsetof(struct specConst, markTiles);
+	specializationEntries[9].size = sizeof(unsigned int);
 
 	VkSpecializationInfo specializationInfo;
-	specializationInfo.mapEntryCount = 8;
+	specializationInfo.mapEntryCount = 10;
 	specializationInfo.pMapEntries = specializationEntries;
 	specializationInfo.dataSize = sizeof(struct specConst);
 	specializationInfo.pData = &spec;
@@ -793,7 +902,18 @@ void createComputePipeline() {
 	writeDescriptor.dstSet = compFrontToBack;
 	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
 
-	// back to front: read image, front to back: write image
+	// lit tiles of the image each one deposits in
+	bufInfo.buffer = tileBuf;
+	bufInfo.offset = litBackOffset;
+	bufInfo.range = blurTilesX * blurTilesY * sizeof(uint32_t);
+	writeDescriptor.dstSet = compBackToFront;
+	writeDescriptor.dstBinding = 3;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	bufInfo.offset = litFrontOffset;
+	writeDescriptor.dstSet = compFrontToBack;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+
+	// back to front: deposit in back image, front to back: sense from back image
 	imgInfo.imageView = backImgView;
 	imgInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 	writeDescriptor.dstSet = compBackToFront;
@@ -802,17 +922,23 @@ void createComputePipeline() {
 	writeDescriptor.pImageInfo = &imgInfo;
 	writeDescriptor.pBufferInfo = NULL;
 	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	imgInfo.imageView = backSensorView;
+	imgInfo.sampler = sensorSampler;
 	writeDescriptor.dstSet = compFrontToBack;
 	writeDescriptor.dstBinding = 2;
+	writeDescriptor.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
 
-	// back to front: write image, front to back: read image
-	imgInfo.imageView = frontImgView;
+	// back to front: sense from front image, front to back: deposit in front image
+	imgInfo.imageView = frontSensorView;
 	writeDescriptor.dstSet = compBackToFront;
 	writeDescriptor.dstBinding = 2;
 	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	imgInfo.imageView = frontImgView;
+	imgInfo.sampler = VK_NULL_HANDLE;
 	writeDescriptor.dstSet = compFrontToBack;
 	writeDescriptor.dstBinding = 1;
+	writeDescriptor.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
 	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
 
 
@@ -820,6 +946,69 @@ void createComputePipeline() {
 	vkDestroyDescriptorSetLayout(dev, setLayout, NULL);
 }
 
+void createInitPipeline() {
+	VkShaderModule initModule = createModule("init.spv");
+
+	struct specConst {
+		int pCount;
+		unsigned int randSeed;
+		unsigned int scrW;
+		unsigned int scrH;
+		int layout;
+	} spec;
+	spec.pCount = simParticleCount;
+	spec.randSeed = vkRandSeed;
+	spec.scrW = simWidth;
+	spec.scrH = simHeight;
+	spec.layout = spawnLayout;
+
+	VkSpecializationMapEntry specializationEntries[5];
+	specializationEntries[0].constantID = 0;
+	specializationEntries[0].offset = offsetof(struct specConst, pCount);
+	specializationEntries[0].size = sizeof(int);
+	specializationEntries[1].constantID = 1;
+	specializationEntries[1].offset = offsetof(struct specConst, randSeed);
+	specializationEntries[1].size = sizeof(unsigned int);
+	specializationEntries[2].constantID = 2;
+	specializationEntries[2].offset = offsetof(struct specConst, scrW);
+	specializationEntries[2].size = sizeof(unsigned int);
+	specializationEntries[3].constantID = 3;
+	specializationEntries[3].offset = offsetof(struct specConst, scrH);
+	specializationEntries[3].size = sizeof(unsigned int);
+	specializationEntries[4].constantID = 4;
+	specializationEntries[4].offset = offsetof(struct specConst, layout);
+	specializationEntries[4].size = sizeof(int);
+
+	VkSpecializationInfo specializationInfo;
+	specializationInfo.mapEntryCount = 5;
+	specializationInfo.pMapEntries = specializationEntries;
+	specializationInfo.dataSize = sizeof(struct specConst);
+	specializationInfo.pData = &spec;
+
+	VkPipelineShaderStageCreateInfo shaderStageInfo;
+	shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStageInfo.pNext = NULL;
+	shaderStageInfo.flags = 0;
+	shaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	shaderStageInfo.module = initModule;
+	shaderStageInfo.pName = "main";
+	shaderStageInfo.pSpecializationInfo = &specializationInfo;
+
+	// Only binding 0 of the compute pipeline's set layout, the particle buffer, is used
+	VkComputePipelineCreateInfo pipelineInfo;
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.pNext = NULL;
+	pipelineInfo.flags = 0;
+	pipelineInfo.stage = shaderStageInfo;
+	pipelineInfo.layout = computePipelineLayout;
+	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+	pipelineInfo.basePipelineIndex = 0;
+	result = vkCreateComputePipelines(dev, VK_NULL_HANDLE, 1, &pipelineInfo, NULL, &initPipeline);
+	vkFail("Failed to create particle init pipeline\n");
+
+	vkDestroyShaderModule(dev, initModule, NULL);
+}
+
 void createGraphicsPipeline() {
 	// Descriptor set layout, reads from both images now
 	VkDescriptorSetLayoutBinding bindings[2];
@@ -908,8 +1097,8 @@ void createGraphicsPipeline() {
 	fbInfo.renderPass = renderPass;
 	fbInfo.attachmentCount = 1;
 	fbInfo.pAttachments = &backImgView;
-	fbInfo.width = screenWidth;
-	fbInfo.height = screenHeight;
+	fbInfo.width = simWidth;
+	fbInfo.height = simHeight;
 	fbInfo.layers = 1;
 	result = vkCreateFramebuffer(dev, &fbInfo, NULL, &backFb);
 	vkFail("Failed to create back framebuffer\n");
@@ -934,6 +1123,11 @@ void createGraphicsPipeline() {
 	for (int i=0; i<9; i++)
 		spec.blurKernel[i] = blurKernel[i];
 	spec.blurDivide = blurDivide;
+	if (diffusionMode) { // already blurred by the diffusion pipelines, only fade
+		for (int i=0; i<9; i++)
+			spec.blurKernel[i] = i == 4;
+		spec.blurDivide = 1;
+	}
 	spec.pR = (float)(particleColor/0x10000 % 0x100) / 0xFF;
 	spec.pG = (float)(particleColor/0x100 % 0x100) / 0xFF;
 	spec.pB = (float)(particleColor % 0x100) / 0XFF;
@@ -1040,16 +1234,16 @@ void createGraphicsPipeline() {
 	VkViewport viewport;
 	viewport.x = 0;
 	viewport.y = 0;
-	viewport.width = screenWidth;
-	viewport.height = screenHeight;
+	viewport.width = simWidth;
+	viewport.height = simHeight;
 	viewport.minDepth = 0.0;
 	viewport.maxDepth = 1.0;
 
 	VkRect2D scissor;
 	scissor.offset.x = 0;
 	scissor.offset.y = 0;
-	scissor.extent.width = screenWidth;
-	scissor.extent.height = screenHeight;
+	scissor.extent.width = simWidth;
+	scissor.extent.height = simHeight;
 
 	VkPipelineViewportStateCreateInfo viewportInfo;
 	viewportInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
@@ -1183,6 +1377,441 @@ void createGraphicsPipeline() {
 	vkDestroyDescriptorSetLayout(dev, setLayout, NULL);
 }
 
+void createDiffusionPipelines() {
+	// Descriptor set layout
+	VkDescriptorSetLayoutBinding bindings[2];
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE; // image particles were deposited in
+	bindings[0].descriptorCount = 1;
+	bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[0].pImmutableSamplers = NULL;
+	bindings[1] = bindings[0];
+	bindings[1].binding = 1; // summed-area table
+	VkDescriptorSetLayoutCreateInfo setLayoutInfo;
+	setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	setLayoutInfo.pNext = NULL;
+	setLayoutInfo.flags = 0;
+	setLayoutInfo.bindingCount = 2;
+	setLayoutInfo.pBindings = bindings;
+
+	VkDescriptorSetLayout setLayout;
+	result = vkCreateDescriptorSetLayout(dev, &setLayoutInfo, NULL, &setLayout);
+	vkFail("Failed to create diffusion pipeline descriptor set layout\n");
+
+	// Pipeline layout
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo;
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.pNext = NULL;
+	pipelineLayoutInfo.flags = 0;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &setLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 0;
+	pipelineLayoutInfo.pPushConstantRanges = NULL;
+
+	result = vkCreatePipelineLayout(dev, &pipelineLayoutInfo, NULL, &diffusionPipelineLayout);
+	vkFail("Failed to create diffusion pipeline layout\n");
+
+	VkShaderModule diffusionModule = createModule("diffusion.spv");
+
+	// One pipeline per stage of the shader
+	struct specConst {
+		int stage;
+		int radius;
+		unsigned int scrW;
+		unsigned int scrH;
+	} spec;
+	spec.radius = boxRadius;
+	spec.scrW = simWidth;
+	spec.scrH = simHeight;
+
+	VkSpecializationMapEntry specializationEntries[4];
+	specializationEntries[0].constantID = 0;
+	specializationEntries[0].offset = offsetof(struct specConst, stage);
+	specializationEntries[0].size = sizeof(int);
+	specializationEntries[1].constantID = 1;
+	specializationEntries[1].offset = offsetof(struct specConst, radius);
+	specializationEntries[1].size = sizeof(int);
+	specializationEntries[2].constantID = 2;
+	specializationEntries[2].offset = offsetof(struct specConst, scrW);
+	specializationEntries[2].size = sizeof(unsigned int);
+	specializationEntries[3].constantID = 3;
+	specializationEntries[3].offset = offsetof(struct specConst, scrH);
+	specializationEntries[3].size = sizeof(unsigned int);
+
+	VkSpecializationInfo specializationInfo;
+	specializationInfo.mapEntryCount = 4;
+	specializationInfo.pMapEntries = specializationEntries;
+	specializationInfo.dataSize = sizeof(struct specConst);
+	specializationInfo.pData = &spec;
+
+	VkPipelineShaderStageCreateInfo shaderStageInfo;
+	shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStageInfo.pNext = NULL;
+	shaderStageInfo.flags = 0;
+	shaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	shaderStageInfo.module = diffusionModule;
+	shaderStageInfo.pName = "main";
+	shaderStageInfo.pSpecializationInfo = &specializationInfo;
+
+	VkComputePipelineCreateInfo pipelineInfo;
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.pNext = NULL;
+	pipelineInfo.flags = 0;
+	pipelineInfo.stage = shaderStageInfo;
+	pipelineInfo.layout = diffusionPipelineLayout;
+	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+	pipelineInfo.basePipelineIndex = 0;
+	for (int i=0; i<3; i++) {
+		spec.stage = i;
+		result = vkCreateComputePipelines(dev, VK_NULL_HANDLE, 1, &pipelineInfo, NULL, diffusionPipelines + i);
+		vkFail("Failed to create diffusion pipeline\n");
+	}
+
+	// Descriptor sets, both share the table
+	VkDescriptorSetAllocateInfo allocInfo;
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.pNext = NULL;
+	allocInfo.descriptorPool = descriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &setLayout;
+	result = vkAllocateDescriptorSets(dev, &allocInfo, &diffuseBack);
+	vkFail("Failed to create diffusion descriptor set\n");
+	result = vkAllocateDescriptorSets(dev, &allocInfo, &diffuseFront);
+	vkFail("Failed to create diffusion descriptor set\n");
+
+	VkWriteDescriptorSet writeDescriptor;
+	VkDescriptorImageInfo imgInfo;
+	imgInfo.sampler = VK_NULL_HANDLE;
+	imgInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	writeDescriptor.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writeDescriptor.pNext = NULL;
+	writeDescriptor.dstArrayElement = 0;
+	writeDescriptor.descriptorCount = 1;
+	writeDescriptor.pTexelBufferView = NULL;
+	writeDescriptor.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	writeDescriptor.pBufferInfo = NULL;
+	writeDescriptor.pImageInfo = &imgInfo;
+
+	writeDescriptor.dstBinding = 0;
+	imgInfo.imageView = backImgView;
+	writeDescriptor.dstSet = diffuseBack;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	imgInfo.imageView = frontImgView;
+	writeDescriptor.dstSet = diffuseFront;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+
+	writeDescriptor.dstBinding = 1;
+	imgInfo.imageView = satImgView;
+	writeDescriptor.dstSet = diffuseBack;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	writeDescriptor.dstSet = diffuseFront;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+
+	vkDestroyShaderModule(dev, diffusionModule, NULL);
+	vkDestroyDescriptorSetLayout(dev, setLayout, NULL);
+}
+
+void createBlurPipeline() {
+	// Descriptor set layout
+	VkDescriptorSetLayoutBinding bindings[4];
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE; // image particles were deposited in
+	bindings[0].descriptorCount = 1;
+	bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[0].pImmutableSamplers = NULL;
+	bindings[1] = bindings[0];
+	bindings[1].binding = 1; // image to blur into
+	bindings[2] = bindings[0];
+	bindings[2].binding = 2;
+	bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER; // lit tiles of the image to blur into
+	bindings[3] = bindings[2];
+	bindings[3].binding = 3; // tile list
+	VkDescriptorSetLayoutCreateInfo setLayoutInfo;
+	setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	setLayoutInfo.pNext = NULL;
+	setLayoutInfo.flags = 0;
+	setLayoutInfo.bindingCount = 4;
+	setLayoutInfo.pBindings = bindings;
+
+	VkDescriptorSetLayout setLayout;
+	result = vkCreateDescriptorSetLayout(dev, &setLayoutInfo, NULL, &setLayout);
+	vkFail("Failed to create blur pipeline descriptor set layout\n");
+
+	// Pipeline layout
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo;
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.pNext = NULL;
+	pipelineLayoutInfo.flags = 0;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &setLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 0;
+	pipelineLayoutInfo.pPushConstantRanges = NULL;
+
+	result = vkCreatePipelineLayout(dev, &pipelineLayoutInfo, NULL, &blurPipelineLayout);
+	vkFail("Failed to create blur pipeline layout\n");
+
+	VkShaderModule blurModule = createModule("blur.spv");
+
+	// Same constants as the fragment shader, plus the screen size
+	struct specConst {
+		float rFade;
+		float gFade;
+		float bFade;
+		float blurKernel[9];
+		float blurDivide;
+		float pR;
+		float pG;
+		float pB;
+		unsigned int scrW;
+		unsigned int scrH;
+		unsigned int tiled;
+	} spec;
+	spec.rFade = (float)redFade / 0xFF;
+	spec.gFade = (float)greenFade / 0xFF;
+	spec.bFade = (float)blueFade / 0xFF;
+	for (int i=0; i<9; i++)
+		spec.blurKernel[i] = diffusionMode ? i == 4 : blurKernel[i];
+	spec.blurDivide = diffusionMode ? 1 : blurDivide;
+	spec.pR = (float)(particleColor/0x10000 % 0x100) / 0xFF;
+	spec.pG = (float)(particleColor/0x100 % 0x100) / 0xFF;
+	spec.pB = (float)(particleColor % 0x100) / 0XFF;
+	spec.scrW = simWidth;
+	spec.scrH = simHeight;
+	spec.tiled = tiledBlur;
+
+	// Every constant is 4 bytes and they are in order of their ids
+	VkSpecializationMapEntry specializationEntries[19];
+	for (int i=0; i<19; i++) {
+		specializationEntries[i].constantID = i;
+		specializationEntries[i].offset = i * 4;
+		specializationEntries[i].size = 4;
+	}
+
+	VkSpecializationInfo specializationInfo;
+	specializationInfo.mapEntryCount = 19;
+	specializationInfo.pMapEntries = specializationEntries;
+	specializationInfo.dataSize = sizeof(struct specConst);
+	specializationInfo.pData = &spec;
+
+	VkPipelineShaderStageCreateInfo shaderStageInfo;
+	shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStageInfo.pNext = NULL;
+	shaderStageInfo.flags = 0;
+	shaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	shaderStageInfo.module = blurModule;
+	shaderStageInfo.pName = "main";
+	shaderStageInfo.pSpecializationInfo = &specializationInfo;
+
+	VkComputePipelineCreateInfo pipelineInfo;
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.pNext = NULL;
+	pipelineInfo.flags = 0;
+	pipelineInfo.stage = shaderStageInfo;
+	pipelineInfo.layout = blurPipelineLayout;
+	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+	pipelineInfo.basePipelineIndex = 0;
+	result = vkCreateComputePipelines(dev, VK_NULL_HANDLE, 1, &pipelineInfo, NULL, &blurPipeline);
+	vkFail("Failed to create blur pipeline\n");
+
+	// Descriptor sets
+	VkDescriptorSetAllocateInfo allocInfo;
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.pNext = NULL;
+	allocInfo.descriptorPool = descriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &setLayout;
+	result = vkAllocateDescriptorSets(dev, &allocInfo, &blurBackToFront);
+	vkFail("Failed to create blur descriptor set\n");
+	result = vkAllocateDescriptorSets(dev, &allocInfo, &blurFrontToBack);
+	vkFail("Failed to create blur descriptor set\n");
+
+	VkWriteDescriptorSet writeDescriptor;
+	VkDescriptorImageInfo imgInfo;
+	imgInfo.sampler = VK_NULL_HANDLE;
+	imgInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	writeDescriptor.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writeDescriptor.pNext = NULL;
+	writeDescriptor.dstArrayElement = 0;
+	writeDescriptor.descriptorCount = 1;
+	writeDescriptor.pTexelBufferView = NULL;
+	writeDescriptor.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	writeDescriptor.pBufferInfo = NULL;
+	writeDescriptor.pImageInfo = &imgInfo;
+
+	imgInfo.imageView = backImgView;
+	writeDescriptor.dstSet = blurBackToFront;
+	writeDescriptor.dstBinding = 0;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	writeDescriptor.dstSet = blurFrontToBack;
+	writeDescriptor.dstBinding = 1;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+
+	imgInfo.imageView = frontImgView;
+	writeDescriptor.dstSet = blurFrontToBack;
+	writeDescriptor.dstBinding = 0;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	writeDescriptor.dstSet = blurBackToFront;
+	writeDescriptor.dstBinding = 1;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+
+	// Blurring into front lights tiles of front, and the other way around. Both read the same list
+	VkDescriptorBufferInfo bufInfo;
+	bufInfo.buffer = tileBuf;
+	bufInfo.offset = litFrontOffset;
+	bufInfo.range = blurTilesX * blurTilesY * sizeof(uint32_t);
+	writeDescriptor.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	writeDescriptor.pImageInfo = NULL;
+	writeDescriptor.pBufferInfo = &bufInfo;
+	writeDescriptor.dstSet = blurBackToFront;
+	writeDescriptor.dstBinding = 2;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	bufInfo.offset = litBackOffset;
+	writeDescriptor.dstSet = blurFrontToBack;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+
+	bufInfo.offset = 0;
+	bufInfo.range = litBackOffset;
+	writeDescriptor.dstBinding = 3;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	writeDescriptor.dstSet = blurBackToFront;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+
+	vkDestroyShaderModule(dev, blurModule, NULL);
+	vkDestroyDescriptorSetLayout(dev, setLayout, NULL);
+}
+
+void createTilesPipeline() {
+	// Descriptor set layout
+	VkDescriptorSetLayoutBinding bindings[3];
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER; // lit tiles of the image particles were deposited in
+	bindings[0].descriptorCount = 1;
+	bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[0].pImmutableSamplers = NULL;
+	bindings[1] = bindings[0];
+	bindings[1].binding = 1; // lit tiles of the image to blur into
+	bindings[2] = bindings[0];
+	bindings[2].binding = 2; // tile list
+	VkDescriptorSetLayoutCreateInfo setLayoutInfo;
+	setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	setLayoutInfo.pNext = NULL;
+	setLayoutInfo.flags = 0;
+	setLayoutInfo.bindingCount = 3;
+	setLayoutInfo.pBindings = bindings;
+
+	VkDescriptorSetLayout setLayout;
+	result = vkCreateDescriptorSetLayout(dev, &setLayoutInfo, NULL, &setLayout);
+	vkFail("Failed to create tiles pipeline descriptor set layout\n");
+
+	// Pipeline layout
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo;
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.pNext = NULL;
+	pipelineLayoutInfo.flags = 0;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &setLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 0;
+	pipelineLayoutInfo.pPushConstantRanges = NULL;
+
+	result = vkCreatePipelineLayout(dev, &pipelineLayoutInfo, NULL, &tilesPipelineLayout);
+	vkFail("Failed to create tiles pipeline layout\n");
+
+	VkShaderModule tilesModule = createModule("tiles.spv");
+
+	struct specConst {
+		unsigned int tilesX;
+		unsigned int tilesY;
+	} spec;
+	spec.tilesX = blurTilesX;
+	spec.tilesY = blurTilesY;
+
+	VkSpecializationMapEntry specializationEntries[2];
+	specializationEntries[0].constantID = 0;
+	specializationEntries[0].offset = offsetof(struct specConst, tilesX);
+	specializationEntries[0].size = sizeof(unsigned int);
+	specializationEntries[1].constantID = 1;
+	specializationEntries[1].offset = offsetof(struct specConst, tilesY);
+	specializationEntries[1].size = sizeof(unsigned int);
+
+	VkSpecializationInfo specializationInfo;
+	specializationInfo.mapEntryCount = 2;
+	specializationInfo.pMapEntries = specializationEntries;
+	specializationInfo.dataSize = sizeof(struct specConst);
+	specializationInfo.pData = &spec;
+
+	VkPipelineShaderStageCreateInfo shaderStageInfo;
+	shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStageInfo.pNext = NULL;
+	shaderStageInfo.flags = 0;
+	shaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	shaderStageInfo.module = tilesModule;
+	shaderStageInfo.pName = "main";
+	shaderStageInfo.pSpecializationInfo = &specializationInfo;
+
+	VkComputePipelineCreateInfo pipelineInfo;
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.pNext = NULL;
+	pipelineInfo.flags = 0;
+	pipelineInfo.stage = shaderStageInfo;
+	pipelineInfo.layout = tilesPipelineLayout;
+	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+	pipelineInfo.basePipelineIndex = 0;
+	result = vkCreateComputePipelines(dev, VK_NULL_HANDLE, 1, &pipelineInfo, NULL, &tilesPipeline);
+	vkFail("Failed to create tiles pipeline\n");
+
+	// Descriptor sets
+	VkDescriptorSetAllocateInfo allocInfo;
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.pNext = NULL;
+	allocInfo.descriptorPool = descriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &setLayout;
+	result = vkAllocateDescriptorSets(dev, &allocInfo, &tilesBackToFront);
+	vkFail("Failed to create tiles descriptor set\n");
+	result = vkAllocateDescriptorSets(dev, &allocInfo, &tilesFrontToBack);
+	vkFail("Failed to create tiles descriptor set\n");
+
+	VkWriteDescriptorSet writeDescriptor;
+	VkDescriptorBufferInfo bufInfo;
+	bufInfo.buffer = tileBuf;
+	writeDescriptor.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writeDescriptor.pNext = NULL;
+	writeDescriptor.dstArrayElement = 0;
+	writeDescriptor.descriptorCount = 1;
+	writeDescriptor.pTexelBufferView = NULL;
+	writeDescriptor.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	writeDescriptor.pImageInfo = NULL;
+	writeDescriptor.pBufferInfo = &bufInfo;
+
+	// back to front: particles were deposited in back, blur into front
+	bufInfo.range = blurTilesX * blurTilesY * sizeof(uint32_t);
+	bufInfo.offset = litBackOffset;
+	writeDescriptor.dstSet = tilesBackToFront;
+	writeDescriptor.dstBinding = 0;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	writeDescriptor.dstSet = tilesFrontToBack;
+	writeDescriptor.dstBinding = 1;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+
+	bufInfo.offset = litFrontOffset;
+	writeDescriptor.dstSet = tilesFrontToBack;
+	writeDescriptor.dstBinding = 0;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	writeDescriptor.dstSet = tilesBackToFront;
+	writeDescriptor.dstBinding = 1;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+
+	bufInfo.offset = 0;
+	bufInfo.range = litBackOffset;
+	writeDescriptor.dstBinding = 2;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+	writeDescriptor.dstSet = tilesFrontToBack;
+	vkUpdateDescriptorSets(dev, 1, &writeDescriptor, 0, NULL);
+
+	vkDestroyShaderModule(dev, tilesModule, NULL);
+	vkDestroyDescriptorSetLayout(dev, setLayout, NULL);
+}
+
 void createCommandBufferPools() {
 	VkCommandPoolCreateInfo poolInfo;
 	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -1206,6 +1835,9 @@ void createSynchronization() {
 	semInfo.pNext = NULL;
 	semInfo.flags = 0;
 	vkCreateSemaphore(dev, &semInfo, NULL, &commandSem);
+	// Frames made only of compute dispatches wait on the swapchains on the GPU instead of with swapFence
+	for (int i=0; i<swapchainCount; i++)
+		vkCreateSemaphore(dev, &semInfo, NULL, acquireSems + i);
 
 	// one fence to wait for the swapchain to give the next image
 	// two fences for help with command buffer synchronization. It looks like this:
@@ -1229,24 +1861,57 @@ void createSynchronization() {
 	vkCreateFence(dev, &fenceInfo, NULL, &commandFence2);
 }
 
-void vkSetup(int monitorIndex) {
+static void createSimulationObjects();
+
+// The monitors are laid out left to right in the order of monitorIndices
+void vkSetup(const int *monitorIndices, int monitorCount) {
 	int isLeased;
 	// Do this now, drmIsMaster(fd) may returns false otherwise
-	fd = getDrmMasterFd(monitorIndex, &isLeased);
+	fd = getDrmMasterFd(monitorIndices, monitorCount, &isLeased);
 
 	createInstance();
 	createLogicalDevice();
 	getExtensionFunctions();
 
-	if (isLeased)
-		monitorIndex = 0;
-	createDisplaySurface(monitorIndex);
-	createSwapchain();
+	swapchainCount = monitorCount;
+	screenWidth = 0;
+	screenHeight = 0;
+	for (int i=0; i<swapchainCount; i++) {
+		// A lease only has the leased connectors, so take them in order
+		createDisplaySurface(isLeased ? 0 : monitorIndices[i], i);
+		createSwapchain(i);
+		displayXOffsets[i] = screenWidth;
+		screenWidth += displayExtents[i].width;
+		if (displayExtents[i].height > screenHeight)
+			screenHeight = displayExtents[i].height;
+	}
+	if (swapchainCount > 1)
+		printf("Spanning %ux%u over %d monitors\n", screenWidth, screenHeight, swapchainCount);
+	simWidth = simulationWidth ? simulationWidth : screenWidth * simulationScale;
+	simHeight = simulationHeight ? simulationHeight : screenHeight * simulationScale;
+	if (simWidth != screenWidth || simHeight != screenHeight)
+		printf("Simulating at %ux%u\n", simWidth, simHeight);
+
+	createSimulationObjects();
+}
+
+// Everything but the display: the simulation runs at width by height and results can only be read back
+void vkSetupHeadless(uint32_t width, uint32_t height) {
+	headless = 1;
+	createInstance();
+	createLogicalDevice();
+	getExtensionFunctions();
 
+	swapchainCount = 0;
+	screenWidth = simWidth = width;
+	screenHeight = simHeight = height;
+	createSimulationObjects();
+}
+
+static void createSimulationObjects() {
 	createResources();
 	allocDeviceMemory();
 	createViews();
-	mapBufs();
 	mappedVertices[0].x = -1.0;
 	mappedVertices[0].y = -1.0;
 	mappedVertices[0].z = 0.5;
@@ -1259,15 +1924,23 @@ void vkSetup(int monitorIndex) {
 
 	createDescriptorPool();
 	createComputePipeline();
+	createInitPipeline();
 	createGraphicsPipeline();
+	if (diffusionMode)
+		createDiffusionPipelines();
+	if (computeOnlyFrames || tiledBlur)
+		createBlurPipeline();
+	if (tiledBlur)
+		createTilesPipeline();
 
 	createCommandBufferPools();
 	createSynchronization();
-	return;
 }
 
 void vkCleanup() {
 	vkDestroySemaphore(dev, commandSem, NULL);
+	for (int i=0; i<swapchainCount; i++)
+		vkDestroySemaphore(dev, acquireSems[i], NULL);
 	vkDestroyFence(dev, swapFence, NULL);
 	vkDestroyFence(dev, commandFence1, NULL);
 	vkDestroyFence(dev, commandFence2, NULL);
@@ -1282,19 +1955,44 @@ void vkCleanup() {
 	vkDestroyRenderPass(dev, renderPass, NULL);
 	vkDestroyDescriptorPool(dev, descriptorPool, NULL);
 	vkDestroyPipeline(dev, computePipeline, NULL);
-	vkUnmapMemory(dev, bufsMem);
+	vkDestroyPipeline(dev, initPipeline, NULL);
+	if (computeOnlyFrames || tiledBlur) {
+		vkDestroyPipeline(dev, blurPipeline, NULL);
+		vkDestroyPipelineLayout(dev, blurPipelineLayout, NULL);
+	}
+	if (tiledBlur) {
+		vkDestroyPipeline(dev, tilesPipeline, NULL);
+		vkDestroyPipelineLayout(dev, tilesPipelineLayout, NULL);
+	}
+	if (diffusionMode) {
+		for (int i=0; i<3; i++)
+			vkDestroyPipeline(dev, diffusionPipelines[i], NULL);
+		vkDestroyPipelineLayout(dev, diffusionPipelineLayout, NULL);
+		vkDestroyImageView(dev, satImgView, NULL);
+		vkDestroyImage(dev, satImg, NULL);
+	}
 	vkDestroyBuffer(dev, vertexBuf, NULL);
 	vkDestroyBuffer(dev, particleBuf, NULL);
+	vkDestroyBuffer(dev, stagingBuf, NULL);
+	vkDestroyBuffer(dev, tileBuf, NULL);
 	vkDestroyImage(dev, frontImg, NULL);
 	vkDestroyImage(dev, backImg, NULL);
+	if (outputImg)
+		vkDestroyImage(dev, outputImg, NULL);
 	vkDestroyImageView(dev, frontImgView, NULL);
 	vkDestroyImageView(dev, backImgView, NULL);
-	vkFreeMemory(dev, imgsMem, NULL);
-	vkFreeMemory(dev, bufsMem, NULL);
+	vkDestroyImageView(dev, frontSensorView, NULL);
+	vkDestroyImageView(dev, backSensorView, NULL);
+	vkDestroySampler(dev, sensorSampler, NULL);
+	freeDeviceMemory();
 	vkDeviceWaitIdle(dev);
-	vkDestroySwapchainKHR(dev, swapchain, NULL);
+	for (int i=0; i<swapchainCount; i++) {
+		vkDestroySwapchainKHR(dev, swapchains[i], NULL);
+		free(images[i]);
+	}
 	vkDestroyDevice(dev, NULL);
-	vkDestroySurfaceKHR(inst, surface, NULL);
+	for (int i=0; i<swapchainCount; i++)
+		vkDestroySurfaceKHR(inst, surfaces[i], NULL);
 	vkDestroyInstance(inst, NULL);
 
 	close(fd);
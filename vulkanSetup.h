@@ -1,32 +1,56 @@
 #include <vulkan/vulkan.h>
+#include "drmMaster.h"
 
 extern uint32_t qFamGraphicsIndex, qFamComputeIndex, qFamTransferIndex;
-extern VkSwapchainKHR swapchain;
-extern uint32_t imgCount;
-extern VkImage *images;
+extern int swapchainCount;
+extern VkSwapchainKHR swapchains[MAX_OUTPUTS];
+extern uint32_t imgCounts[MAX_OUTPUTS];
+extern VkImage *images[MAX_OUTPUTS];
+extern VkExtent2D displayExtents[MAX_OUTPUTS];
+extern uint32_t displayXOffsets[MAX_OUTPUTS];
 extern VkDevice dev;
 
 extern VkQueue graphicsQueue, computeQueue, transferQueue;
 extern uint32_t screenWidth, screenHeight, refreshRate;
+extern uint32_t simWidth, simHeight;
 
 extern VkBuffer vertexBuf;
-extern VkImage frontImg, backImg;
+extern VkImage frontImg, backImg, satImg, outputImg;
+// 16.8 fixed point position in the top 24 bits of x and y, and the 16 bit heading split over their low
+// 8 bits, high byte in x. compute.comp and init.comp pack it the same way
 typedef struct {
-	float posX, posY, dirX, dirY, angle;
+	uint32_t x, y;
 } vkParticle;
-extern vkParticle *mappedParticles;
+extern VkBuffer particleBuf, stagingBuf;
+extern uint32_t *mappedStaging;
+extern vkParticle *stagedParticles;
+extern VkDeviceSize stagedParticlesOffset;
+// Blurring only active tiles, see tiles.comp
+extern VkBuffer tileBuf;
+extern int tiledBlur;
+extern uint32_t blurTilesX, blurTilesY;
 
 extern VkPipelineLayout computePipelineLayout, graphicsPipelineLayout;
-extern VkPipeline computePipeline, graphicsPipeline;
+extern VkPipeline computePipeline, graphicsPipeline, initPipeline;
+extern VkPipelineLayout diffusionPipelineLayout;
+extern VkPipeline diffusionPipelines[3];
+extern VkPipelineLayout blurPipelineLayout;
+extern VkPipeline blurPipeline;
+extern VkPipelineLayout tilesPipelineLayout;
+extern VkPipeline tilesPipeline;
 extern VkFramebuffer backFb, frontFb;
 extern VkRenderPass renderPass;
 extern VkDescriptorSet compBackToFront, compFrontToBack, graphicsBack, graphicsFront;
+extern VkDescriptorSet diffuseBack, diffuseFront;
+extern VkDescriptorSet blurBackToFront, blurFrontToBack;
+extern VkDescriptorSet tilesBackToFront, tilesFrontToBack;
 
 extern VkCommandPool computePool, graphicsPool, transferPool;
-extern VkSemaphore commandSem;
+extern VkSemaphore commandSem, acquireSems[MAX_OUTPUTS];
 extern VkFence swapFence, commandFence1, commandFence2;
 
-void vkSetup(int monitorIndex);
+void vkSetup(const int *monitorIndices, int monitorCount);
+void vkSetupHeadless(uint32_t width, uint32_t height);
 void vkCleanup();
 
 extern VkResult (*vkQueuePresent) (VkQueue queue, const VkPresentInfoKHR *pPresentInfo);
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "workers.h"
+
+// Worker 0 is the thread calling runOnWorkers, the others wait for jobs on their own threads.
+// Every worker is pinned to its own CPU, so memory it touches first stays on its NUMA node
+int workerCount = 1;
+
+static pthread_t threads[MAX_WORKERS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobReady = PTHREAD_COND_INITIALIZER, jobDone = PTHREAD_COND_INITIALIZER;
+// Protected by lock. generation counts the jobs started, busyWorkers the threads still on the current one
+static workerJob currentJob;
+static void *currentArg;
+static unsigned long generation;
+static int busyWorkers;
+static int stopping;
+
+static void pinToCpu(pthread_t thread, int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(thread, sizeof(set), &set))
+		fprintf(stderr, "Couldn't pin a worker to CPU %d\n", cpu);
+}
+
+static void *workerLoop(void *arg) {
+	int worker = (intptr_t) arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (generation == seen && !stopping)
+			pthread_cond_wait(&jobReady, &lock);
+		if (stopping)
+			break;
+		seen = generation;
+		workerJob job = currentJob;
+		void *jobArg = currentArg;
+		pthread_mutex_unlock(&lock);
+
+		job(worker, jobArg);
+
+		pthread_mutex_lock(&lock);
+		if (--busyWorkers == 0)
+			pthread_cond_signal(&jobDone);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+// count of 0 uses every CPU the process may run on
+void startWorkers(int count) {
+	int cpus[MAX_WORKERS];
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		fprintf(stderr, "Couldn't get the CPUs to run workers on\n");
+		abort();
+	}
+	int available = 0;
+	for (int cpu=0; cpu<CPU_SETSIZE && available<MAX_WORKERS; cpu++) {
+		if (CPU_ISSET(cpu, &allowed))
+			cpus[available++] = cpu;
+	}
+	// More workers than CPUs share them round robin
+	workerCount = count > 0 ? (count < MAX_WORKERS ? count : MAX_WORKERS) : available;
+
+	pinToCpu(pthread_self(), cpus[0]);
+	for (int i=1; i<workerCount; i++) {
+		if (pthread_create(threads + i, NULL, workerLoop, (void*) (intptr_t) i)) {
+			fprintf(stderr, "Couldn't create worker thread %d\n", i);
+			abort();
+		}
+		pinToCpu(threads[i], cpus[i % available]);
+	}
+}
+
+// Runs job on every worker at once and returns when all of them are done
+void runOnWorkers(workerJob job, void *arg) {
+	if (workerCount == 1) {
+		job(0, arg);
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	currentJob = job;
+	currentArg = arg;
+	busyWorkers = workerCount - 1;
+	generation++;
+	pthread_cond_broadcast(&jobReady);
+	pthread_mutex_unlock(&lock);
+
+	job(0, arg);
+
+	pthread_mutex_lock(&lock);
+	while (busyWorkers)
+		pthread_cond_wait(&jobDone, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+// The part [begin, end) of count items worker owns. Always the same for the same count,
+// so the workers that first touched some memory keep working on it
+void workerRange(int worker, unsigned int count, unsigned int *begin, unsigned int *end) {
+	partRange(worker, workerCount, count, begin, end);
+}
+
+// The part [begin, end) of count items that is part out of parts
+void partRange(int part, int parts, unsigned int count, unsigned int *begin, unsigned int *end) {
+	*begin = (unsigned long long) count * part / parts;
+	*end = (unsigned long long) count * (part + 1) / parts;
+}
+
+typedef struct {
+	task *tasks;
+	int count;
+} taskGraph;
+
+static int dependenciesDone(const taskGraph *graph, const task *t) {
+	for (int i=0; i<t->dependencyCount; i++) {
+		const task *dependency = graph->tasks + t->dependencies[i];
+		if (__atomic_load_n(&dependency->partsDone, __ATOMIC_ACQUIRE) < dependency->parts)
+			return 0;
+	}
+	return 1;
+}
+
+// The next part of t for worker to run, -1 when none is left
+static int takePart(task *t, int worker) {
+	if (!t->byOwner) {
+		if (__atomic_load_n(&t->nextPart, __ATOMIC_RELAXED) >= t->parts)
+			return -1;
+		int part = __atomic_fetch_add(&t->nextPart, 1, __ATOMIC_RELAXED);
+		return part < t->parts ? part : -1;
+	}
+	for (int i=0; i<workerCount; i++) {
+		int owner = (worker + i) % workerCount;
+		unsigned int begin, end;
+		workerRange(owner, t->parts, &begin, &end);
+		if (begin + __atomic_load_n(&t->nextOwnedPart[owner], __ATOMIC_RELAXED) >= end)
+			continue;
+		unsigned int part = begin + __atomic_fetch_add(&t->nextOwnedPart[owner], 1, __ATOMIC_RELAXED);
+		if (part < end)
+			return part;
+	}
+	return -1;
+}
+
+// Every worker takes the next part of the first task that has parts left and can start, until all are done
+static void taskLoop(int worker, void *arg) {
+	taskGraph *graph = arg;
+	while (1) {
+		int allDone = 1, ran = 0;
+		for (int i=0; i<graph->count && !ran; i++) {
+			task *t = graph->tasks + i;
+			if (__atomic_load_n(&t->partsDone, __ATOMIC_ACQUIRE) == t->parts)
+				continue;
+			allDone = 0;
+			if (!dependenciesDone(graph, t))
+				continue;
+			int part = takePart(t, worker);
+			if (part < 0)
+				continue;
+			t->job(worker, part, t->arg);
+			__atomic_fetch_add(&t->partsDone, 1, __ATOMIC_RELEASE);
+			ran = 1;
+		}
+		if (allDone)
+			return;
+		// Only parts other workers are on or tasks waiting for them are left
+		if (!ran)
+			sched_yield();
+	}
+}
+
+// Runs the task graph on the workers and returns when every task is done. Tasks earlier in tasks go first
+// when more than one can run
+void runTasks(task *tasks, int count) {
+	for (int i=0; i<count; i++) {
+		tasks[i].nextPart = tasks[i].partsDone = 0;
+		memset(tasks[i].nextOwnedPart, 0, workerCount * sizeof(int));
+	}
+	taskGraph graph = {tasks, count};
+	runOnWorkers(taskLoop, &graph);
+}
+
+void stopWorkers() {
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&jobReady);
+	pthread_mutex_unlock(&lock);
+	for (int i=1; i<workerCount; i++)
+		pthread_join(threads[i], NULL);
+	workerCount = 1;
+}
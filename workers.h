@@ -0,0 +1,30 @@
+// Most threads the CPU simulation can run on
+#define MAX_WORKERS 64
+
+typedef void (*workerJob)(int worker, void *arg);
+
+extern int workerCount;
+
+void startWorkers(int count);
+void runOnWorkers(workerJob job, void *arg);
+void workerRange(int worker, unsigned int count, unsigned int *begin, unsigned int *end);
+void stopWorkers();
+
+// Part of a task graph: a job split into parts that any worker takes one at a time, started once every task it
+// depends on is done. Dependencies are indices of earlier tasks. With byOwner, every worker first takes the parts
+// workerRange() gives it, so they run where their memory was first touched, and only then helps with the others'
+#define MAX_TASK_DEPENDENCIES 4
+typedef void (*taskJob)(int worker, int part, void *arg);
+typedef struct {
+	taskJob job;
+	void *arg;
+	int parts;
+	int dependencies[MAX_TASK_DEPENDENCIES];
+	int dependencyCount;
+	int byOwner;
+	int nextPart, partsDone; // set by runTasks()
+	int nextOwnedPart[MAX_WORKERS]; // with byOwner, counted from the first part of each worker
+} task;
+
+void runTasks(task *tasks, int count);
+void partRange(int part, int parts, unsigned int count, unsigned int *begin, unsigned int *end);